@@ -0,0 +1,232 @@
+/*
+ * File: accesslog.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "accesslog.h"
+#include "service.h"
+
+#define LOG_LINE_MAX 192
+
+/*
+ * Single-producer single-consumer ring. The worker owning the process
+ * is the only producer and the drainer thread the only consumer, so
+ * head and tail are each written by exactly one side.
+ */
+static log_record ring[LOG_RING_SIZE];
+static _Atomic uint64_t ring_head;
+static _Atomic uint64_t ring_tail;
+static _Atomic uint64_t dropped;
+static uint64_t reported_drops;     // by the drainer, of 'dropped'
+static _Atomic int stopping;
+
+static pid_t owner_pid;
+static int wakeup_fd = -1;
+static pthread_t drainer;
+
+static const char *event_str[] = {"connect", "open", "request", "close"};
+
+static int format_peer(const log_peer *peer, char *out, int size) {
+
+    char addr[INET6_ADDRSTRLEN];
+
+    // forwarded by a proxy, see listener_forwarded_peer(), the port is not known
+    if (peer->family == AF_INET && !peer->port) {
+        return snprintf(out, size, "%s", inet_ntop(AF_INET, peer->addr, addr, sizeof(addr)));
+    } else if (peer->family == AF_INET6 && !peer->port) {
+        return snprintf(out, size, "[%s]", inet_ntop(AF_INET6, peer->addr, addr, sizeof(addr)));
+    } else if (peer->family == AF_INET) {
+        inet_ntop(AF_INET, peer->addr, addr, sizeof(addr));
+        return snprintf(out, size, "%s:%u", addr, peer->port);
+    } else if (peer->family == AF_INET6) {
+        inet_ntop(AF_INET6, peer->addr, addr, sizeof(addr));
+        return snprintf(out, size, "[%s]:%u", addr, peer->port);
+    } else if (peer->family == AF_UNIX) {
+        return snprintf(out, size, "unix");
+    }
+    return snprintf(out, size, "-");
+}
+
+static int format_record(const log_record *r, char *out, int size) {
+
+    char stamp[32], peer[INET6_ADDRSTRLEN + 16];
+    time_t secs = r->timestamp_ns / 1000000000;
+    struct tm tm;
+
+    gmtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    format_peer(&r->peer, peer, sizeof(peer));
+
+    int len;
+    if (r->event != LOG_REQUEST)
+        len = snprintf(out, size, "%s.%03dZ %d %s %s\n", stamp,
+                       (int)(r->timestamp_ns / 1000000 % 1000), r->pid,
+                       peer, event_str[r->event]);
+    else
+        len = snprintf(out, size, "%s.%03dZ %d %s request %s %u %llu %.3fms\n", stamp,
+                       (int)(r->timestamp_ns / 1000000 % 1000), r->pid, peer,
+                       r->command < NOTA ? command_str[r->command] : "-",
+                       r->status, (unsigned long long)r->bytes, r->latency_ns / 1e6);
+
+    return len < size ? len : size - 1;
+}
+
+static void write_all(const char *buf, int len) {
+
+    while (len > 0) {
+        int n = write(STDOUT_FILENO, buf, len);
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Formats everything currently in the ring and writes it with as few
+ * write() calls as possible.
+ */
+static void drain(void) {
+
+    static char batch[LOG_BATCH * LOG_LINE_MAX];
+    uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    int len = 0;
+
+    for (; tail != head; tail++) {
+        if (len > (int)sizeof(batch) - LOG_LINE_MAX) {
+            write_all(batch, len);
+            len = 0;
+        }
+        len += format_record(&ring[tail & (LOG_RING_SIZE - 1)], batch + len, LOG_LINE_MAX);
+        atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+    }
+
+    uint64_t drops = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (drops != reported_drops) {
+        if (len > (int)sizeof(batch) - LOG_LINE_MAX) {
+            write_all(batch, len);
+            len = 0;
+        }
+        len += snprintf(batch + len, LOG_LINE_MAX, "accesslog: %d dropped %llu records\n",
+                        (int)owner_pid, (unsigned long long)(drops - reported_drops));
+        reported_drops = drops;
+    }
+
+    if (len) write_all(batch, len);
+}
+
+static void *drainer_main(void *arg) {
+
+    struct pollfd pfd = {wakeup_fd, POLLIN, 0};
+    eventfd_t counter;
+
+    while (!atomic_load(&stopping)) {
+        if (poll(&pfd, 1, 100) > 0) eventfd_read(wakeup_fd, &counter);
+        drain();
+    }
+    drain();
+    return NULL;
+}
+
+/*
+ * Starts the drainer thread for the calling process. Threads do not
+ * survive fork(), so a child must call this again; records inherited
+ * from the parent are discarded since the parent flushes its own.
+ */
+void accesslog_init(void) {
+
+    if (owner_pid == getpid()) return;
+
+    if (wakeup_fd != -1) close(wakeup_fd);
+    owner_pid = getpid();
+    atomic_store(&ring_tail, atomic_load(&ring_head));
+    atomic_store(&dropped, 0);
+    reported_drops = 0;
+    atomic_store(&stopping, 0);
+
+    // signals are meant for the worker, keep them away from the drainer
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd == -1 || pthread_create(&drainer, NULL, drainer_main, NULL)) {
+        perror("accesslog");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Stops the drainer after it has flushed every queued record.
+ */
+void accesslog_shutdown(void) {
+
+    if (owner_pid != getpid()) return;
+
+    atomic_store(&stopping, 1);
+    eventfd_write(wakeup_fd, 1);
+    pthread_join(drainer, NULL);
+    owner_pid = 0;
+}
+
+void accesslog_peer(log_peer *peer, const struct sockaddr *sa) {
+
+    memset(peer, 0, sizeof(*peer));
+    peer->family = sa->sa_family;
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)sa;
+        peer->port = ntohs(in->sin_port);
+        memcpy(peer->addr, &in->sin_addr, 4);
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)sa;
+        peer->port = ntohs(in6->sin6_port);
+        memcpy(peer->addr, &in6->sin6_addr, 16);
+    }
+}
+
+/*
+ * Queues a record without blocking. If the drainer has fallen behind
+ * and the ring is full, the record is counted as dropped instead.
+ */
+void accesslog_write(log_event event, const log_peer *peer, int command, int status, uint64_t bytes, int64_t latency_ns) {
+
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    uint64_t queued = head - atomic_load_explicit(&ring_tail, memory_order_acquire);
+
+    if (queued >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_record *r = &ring[head & (LOG_RING_SIZE - 1)];
+    r->timestamp_ns = realtime_ns();
+    r->latency_ns = latency_ns;
+    r->bytes = bytes;
+    if (peer) r->peer = *peer;
+    else memset(&r->peer, 0, sizeof(r->peer));
+    r->pid = owner_pid;
+    r->status = status;
+    r->event = event;
+    r->command = command;
+    atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+
+    if (queued + 1 == LOG_BATCH) eventfd_write(wakeup_fd, 1);
+}
+
+uint64_t accesslog_dropped(void) {
+
+    return atomic_load(&dropped);
+}
@@ -0,0 +1,45 @@
+/*
+ * File: accesslog.h
+ */
+
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define LOG_RING_SIZE 4096   // records per process, must be a power of two
+#define LOG_BATCH 64         // records queued before the drainer is woken up
+
+typedef enum {
+    LOG_CONNECT, LOG_OPEN, LOG_REQUEST, LOG_CLOSE
+} log_event;
+
+typedef struct log_peer {
+    uint16_t family;
+    uint16_t port;
+    uint8_t addr[16];
+} log_peer;
+
+/*
+ * Fixed-size access log record. Workers only copy these into the
+ * ring; all formatting is done by the drainer thread.
+ */
+typedef struct log_record {
+    int64_t timestamp_ns;
+    int64_t latency_ns;
+    uint64_t bytes;
+    log_peer peer;
+    int32_t pid;
+    uint16_t status;
+    uint8_t event;
+    uint8_t command;
+} log_record;
+
+void accesslog_init(void);
+void accesslog_shutdown(void);
+void accesslog_peer(log_peer* peer, const struct sockaddr* sa);
+void accesslog_write(log_event event, const log_peer* peer, int command, int status, uint64_t bytes, int64_t latency_ns);
+uint64_t accesslog_dropped(void);
+
+#endif
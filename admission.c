@@ -0,0 +1,310 @@
+/*
+ * File: admission.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "admission.h"
+
+/*
+ * Admission control. Every worker is a separate process, so the load
+ * figures and the per-client token buckets live in a shared mapping
+ * set up by the parent before it forks. The parent refuses connections
+ * outright once the server is overloaded, without forking a worker for
+ * them; workers refuse single requests. Refusals are answered with
+ * responses built once, up front.
+ *
+ * A worker may die at any point, so nothing it holds may stay held:
+ * the requests it has in flight are counted against its pid as well,
+ * and given back when it is reaped, and the bucket locks are robust
+ * mutexes, which pass to the next process when their owner dies.
+ */
+
+#define DELAY_FRESH_NS 1000000000LL   // delay samples older than this say nothing about now
+#define MILLI 1000
+
+typedef struct bucket {
+    pthread_mutex_t lock;
+    int used;
+    log_peer key;           // the client address, without the port
+    int64_t tokens;         // in thousandths of a token
+    int64_t updated_ns;
+} bucket;
+
+// the requests one worker has in flight
+typedef struct worker_slot {
+    atomic_int pid;         // 0 when free
+    atomic_int in_flight;
+} worker_slot;
+
+typedef struct admission_state {
+    atomic_int connections;         // workers alive, over all acceptors
+    atomic_int in_flight;
+    worker_slot workers[ADMISSION_WORKERS];
+    atomic_llong delay_ns;          // moving average of the queueing delay
+    atomic_llong delay_updated_ns;
+    bucket buckets[ADMISSION_BUCKETS];
+} admission_state;
+
+admission_config admission_conf = {
+    0,      // max_connections
+    0,      // max_inflight
+    0,      // max_queue_delay
+    0,      // rate_limit
+    0,      // rate_burst
+    10      // expensive_cost
+};
+
+static admission_state *state;
+static worker_slot *mine;   // this worker's, once it handled a request
+
+static const char shed_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: " ADMISSION_RETRY_AFTER "\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+static const char limited_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Retry-After: " ADMISSION_RETRY_AFTER "\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+// must be called before the first fork() so that every worker shares the state
+void admission_init(void) {
+
+    pthread_mutexattr_t attr;
+    int i;
+
+    state = mmap(NULL, sizeof(admission_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("admission");
+        exit(1);
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < ADMISSION_BUCKETS; i++) pthread_mutex_init(&state->buckets[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static unsigned slot_index(pid_t pid) {
+
+    return ((unsigned)pid * 2654435761u) & (ADMISSION_WORKERS - 1);
+}
+
+// claims a slot for the calling worker, NULL if there is none left
+static worker_slot *claim_slot(void) {
+
+    pid_t pid = getpid();
+    unsigned start = slot_index(pid), i;
+
+    for (i = 0; i < ADMISSION_WORKERS; i++) {
+        worker_slot *slot = &state->workers[(start + i) & (ADMISSION_WORKERS - 1)];
+        int free_slot = 0;
+        if (atomic_compare_exchange_strong(&slot->pid, &free_slot, pid)) return slot;
+    }
+    return NULL;
+}
+
+static void count_in(void) {
+
+    atomic_fetch_add(&state->in_flight, 1);
+    if (mine) atomic_fetch_add(&mine->in_flight, 1);
+}
+
+static void count_out(void) {
+
+    if (mine) atomic_fetch_sub(&mine->in_flight, 1);
+    atomic_fetch_sub(&state->in_flight, 1);
+}
+
+/*
+ * Gives back what 'worker' still had in flight when it died. Called by
+ * whoever reaps it, from a SIGCHLD handler too.
+ */
+void admission_release(pid_t worker) {
+
+    unsigned start = slot_index(worker), i;
+
+    if (!state) return;
+    for (i = 0; i < ADMISSION_WORKERS; i++) {
+        worker_slot *slot = &state->workers[(start + i) & (ADMISSION_WORKERS - 1)];
+        if (atomic_load(&slot->pid) != worker) continue;
+        atomic_fetch_sub(&state->in_flight, atomic_exchange(&slot->in_flight, 0));
+        atomic_store(&slot->pid, 0);
+        return;
+    }
+}
+
+// counts a worker forked for a connection, or one that has been reaped, from a SIGCHLD handler too
+void admission_connection_opened(void) {
+
+    atomic_fetch_add(&state->connections, 1);
+}
+
+void admission_connection_closed(void) {
+
+    atomic_fetch_sub(&state->connections, 1);
+}
+
+// returns 1 if a new connection should be turned away
+int admission_overloaded(void) {
+
+    if (admission_conf.max_connections && atomic_load(&state->connections) >= admission_conf.max_connections) return 1;
+    if (admission_conf.max_inflight && atomic_load(&state->in_flight) >= admission_conf.max_inflight) return 1;
+    if (admission_conf.max_queue_delay &&
+        monotonic_ns() - atomic_load(&state->delay_updated_ns) < DELAY_FRESH_NS &&
+        atomic_load(&state->delay_ns) > (int64_t)admission_conf.max_queue_delay * 1000000) return 1;
+    return 0;
+}
+
+/*
+ * Adds a sample of the time from a request being received completely
+ * to its handler starting, which grows when workers wait for a CPU.
+ */
+void admission_record_delay(int64_t delay_ns) {
+
+    long long average = atomic_load(&state->delay_ns);
+    while (!atomic_compare_exchange_weak(&state->delay_ns, &average, average + (delay_ns - average) / 8));
+    atomic_store(&state->delay_updated_ns, monotonic_ns());
+}
+
+static uint64_t hash_peer(const log_peer *peer) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p = (const unsigned char *)peer;
+    size_t i;
+
+    for (i = 0; i < sizeof(*peer); i++) hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+// a bucket whose last owner died halfway through is started afresh
+static void lock(bucket *b) {
+    if (pthread_mutex_lock(&b->lock) == EOWNERDEAD) {
+        b->used = 0;
+        pthread_mutex_consistent(&b->lock);
+    }
+}
+
+static void unlock(bucket *b) {
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Takes 'cost' tokens from the bucket of the client at 'peer'. Returns
+ * 0 if it does not hold that many. When every slot the client could
+ * use is taken, the least recently used of them is handed over.
+ */
+static int take_tokens(const log_peer *peer, int cost) {
+
+    int64_t burst = admission_conf.rate_burst ? admission_conf.rate_burst : admission_conf.rate_limit;
+    int64_t now = monotonic_ns();
+    bucket *b = NULL, *oldest = NULL;
+    log_peer key = *peer;
+    uint64_t hash;
+    int i, ok;
+
+    // an expensive request must fit in a full bucket
+    if (burst < admission_conf.expensive_cost) burst = admission_conf.expensive_cost;
+    burst *= MILLI;
+
+    key.port = 0;
+    hash = hash_peer(&key);
+    for (i = 0; i < ADMISSION_PROBE && !b; i++) {
+        bucket *slot = &state->buckets[(hash + i) & (ADMISSION_BUCKETS - 1)];
+        lock(slot);
+        if (slot->used && !memcmp(&slot->key, &key, sizeof(key))) {
+            b = slot;
+            break;
+        }
+        if (!slot->used) {
+            slot->used = 1;
+            slot->key = key;
+            slot->tokens = burst;
+            slot->updated_ns = now;
+            b = slot;
+            break;
+        }
+        if (!oldest || slot->updated_ns < oldest->updated_ns) oldest = slot;
+        unlock(slot);
+    }
+    if (!b) {
+        b = oldest;
+        lock(b);
+        b->key = key;
+        b->tokens = burst;
+        b->updated_ns = now;
+    }
+
+    b->tokens += (now - b->updated_ns) * admission_conf.rate_limit / (1000000000 / MILLI);
+    if (b->tokens > burst) b->tokens = burst;
+    b->updated_ns = now;
+    ok = b->tokens >= (int64_t)cost * MILLI;
+    if (ok) b->tokens -= (int64_t)cost * MILLI;
+    unlock(b);
+    return ok;
+}
+
+/*
+ * Decides whether a worker handles the request for 'command' from
+ * 'peer'. An admitted request has to be followed by admission_end()
+ * once its response is queued.
+ */
+admission_verdict admission_begin(const log_peer *peer, command_type command) {
+
+    if (!mine) mine = claim_slot();
+    count_in();
+    if (admission_conf.max_inflight && atomic_load(&state->in_flight) > admission_conf.max_inflight) {
+        count_out();
+        return ADMIT_SHED;
+    }
+    if (admission_conf.rate_limit &&
+        !take_tokens(peer, command == GET_FILE || command == GET_FILES || command == PUT_FILE ? admission_conf.expensive_cost : 1)) {
+        count_out();
+        return ADMIT_LIMITED;
+    }
+    return ADMIT;
+}
+
+void admission_end(void) {
+
+    count_out();
+}
+
+// the complete HTTP/1.1 response for a refusal, not to be freed
+const char *admission_response(admission_verdict verdict, size_t *length) {
+
+    if (verdict == ADMIT_SHED) {
+        *length = sizeof(shed_response) - 1;
+        return shed_response;
+    }
+    *length = sizeof(limited_response) - 1;
+    return limited_response;
+}
+
+// the same refusal as a response_info, for serializers other than HTTP/1.1
+void admission_reject(admission_verdict verdict, response_info *response) {
+
+    memset(response, 0, sizeof(response_info));
+    response->file_fd = -1;
+    if (verdict == ADMIT_SHED) {
+        response->status_code = "503";
+        response->status_msg = "Service Unavailable";
+        response->connection = "close";
+    } else {
+        response->status_code = "429";
+        response->status_msg = "Too Many Requests";
+        response->connection = "keep-alive";
+    }
+    response->cache_control = "no-cache";
+    response->content_length = "0";
+    response->retry_after = ADMISSION_RETRY_AFTER;
+}
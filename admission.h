@@ -0,0 +1,48 @@
+/*
+ * File: admission.h
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "service.h"
+
+#define ADMISSION_BUCKETS 8192    // per-client token buckets, must be a power of two
+#define ADMISSION_PROBE 8         // slots looked at before a bucket is recycled
+#define ADMISSION_WORKERS 4096    // workers whose requests in flight are known, a power of two
+#define ADMISSION_RETRY_AFTER "1" // seconds, sent with every rejection
+
+/*
+ * Overload thresholds. A value of 0 disables the corresponding check.
+ */
+typedef struct admission_config {
+    int max_connections;    // workers alive at once
+    int max_inflight;       // requests being handled at once, over all workers
+    int max_queue_delay;    // ms from a request being received to it being handled
+    int rate_limit;         // tokens per second and client address
+    int rate_burst;         // bucket size, in tokens
+    int expensive_cost;     // tokens taken by /getfile, /getfiles and /putfile, others take 1
+} admission_config;
+
+extern admission_config admission_conf;
+
+typedef enum {
+    ADMIT, ADMIT_SHED, ADMIT_LIMITED
+} admission_verdict;
+
+void admission_init(void);
+void admission_connection_opened(void);
+void admission_connection_closed(void);
+int admission_overloaded(void);
+void admission_record_delay(int64_t delay_ns);
+admission_verdict admission_begin(const log_peer *peer, command_type command);
+void admission_end(void);
+void admission_release(pid_t worker);
+const char *admission_response(admission_verdict verdict, size_t *length);
+void admission_reject(admission_verdict verdict, response_info *response);
+
+#endif
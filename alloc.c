@@ -0,0 +1,259 @@
+/*
+ * File: alloc.c
+ */
+
+#ifdef ALLOC_ACCOUNTING
+
+#define ALLOC_IMPLEMENTATION
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "alloc.h"
+#include "util.h"
+
+/*
+ * The counters of every call site live in a shared mapping, so that
+ * the report covers all workers. Each process also keeps the blocks it
+ * allocated and where, to charge a free() to the right site; blocks a
+ * worker still holds when its connection ends are counted as leaked.
+ */
+
+typedef struct alloc_site {
+    atomic_int state;           // 0: free, 1: being claimed, 2: in use
+    int command;
+    int line;
+    const char *file;           // string literals, at the same address in every worker
+    const char *function;
+    atomic_llong calls;
+    atomic_llong total;
+    atomic_llong live;
+    atomic_llong leaked;        // still allocated when a worker was done
+} alloc_site;
+
+typedef struct tracked {
+    void *ptr;
+    size_t size;
+    alloc_site *site;
+} tracked;
+
+int alloc_command = -1;         // the server itself, until a worker says otherwise
+
+static alloc_site *sites;
+static tracked *table;          // open addressing on the block address
+static size_t table_size, table_used;
+
+static size_t slot_of(const void *ptr, size_t size) {
+
+    return (((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL) & (size - 1);
+}
+
+static void insert(tracked entry);
+
+static void grow_table(void) {
+
+    tracked *old = table;
+    size_t old_size = table_size, i;
+
+    table_size = table_size ? table_size * 2 : 4096;
+    table = calloc(table_size, sizeof(tracked));
+    table_used = 0;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].ptr) insert(old[i]);
+    }
+    free(old);
+}
+
+static void insert(tracked entry) {
+
+    size_t i;
+
+    if (2 * (table_used + 1) > table_size) grow_table();
+    for (i = slot_of(entry.ptr, table_size); table[i].ptr; i = (i + 1) & (table_size - 1)) {
+        // freed by a file that is not accounted, and handed out again
+        if (table[i].ptr == entry.ptr) {
+            atomic_fetch_sub(&table[i].site->live, table[i].size);
+            table[i] = entry;
+            return;
+        }
+    }
+    table[i] = entry;
+    table_used++;
+}
+
+// forgets 'ptr', closing the gap it leaves in its probe sequence
+static void remove_block(void *ptr) {
+
+    size_t i, j;
+
+    if (!table_size) return;
+    for (i = slot_of(ptr, table_size); table[i].ptr != ptr; i = (i + 1) & (table_size - 1)) {
+        if (!table[i].ptr) return;
+    }
+    atomic_fetch_sub(&table[i].site->live, table[i].size);
+    table[i].ptr = NULL;
+    table_used--;
+    for (j = (i + 1) & (table_size - 1); table[j].ptr; j = (j + 1) & (table_size - 1)) {
+        size_t home = slot_of(table[j].ptr, table_size);
+        // move it back if its home lies cyclically outside (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            table[i] = table[j];
+            table[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+static alloc_site *site_for(const char *file, int line, const char *function) {
+
+    uint64_t hash = ((uintptr_t)file * 31 + line) * 0x9e3779b97f4a7c15ULL + alloc_command;
+    size_t n;
+
+    for (n = 0; n < ALLOC_SITES; n++) {
+        alloc_site *site = &sites[(hash + n) & (ALLOC_SITES - 1)];
+        int state = atomic_load(&site->state);
+
+        if (state == 0) {
+            int expected = 0;
+            if (atomic_compare_exchange_strong(&site->state, &expected, 1)) {
+                site->command = alloc_command;
+                site->file = file;
+                site->line = line;
+                site->function = function;
+                atomic_store(&site->state, 2);
+                return site;
+            }
+            state = expected;
+        }
+        while (state == 1) state = atomic_load(&site->state);
+        if (site->file == file && site->line == line && site->command == alloc_command) return site;
+    }
+    return NULL;    // full, the rest goes uncounted
+}
+
+static void track(void *ptr, size_t size, const char *file, int line, const char *function) {
+
+    alloc_site *site;
+
+    if (!sites || !ptr || !(site = site_for(file, line, function))) return;
+    atomic_fetch_add(&site->calls, 1);
+    atomic_fetch_add(&site->total, size);
+    atomic_fetch_add(&site->live, size);
+    insert((tracked){ptr, size, site});
+}
+
+// a child of fork() does not own what its parent allocated
+static void forget_inherited(void) {
+
+    memset(table, 0, table_size * sizeof(tracked));
+    table_used = 0;
+}
+
+// must be called before the first fork() so that every worker shares the counters
+void alloc_init(void) {
+
+    sites = mmap(NULL, ALLOC_SITES * sizeof(alloc_site), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sites == MAP_FAILED) {
+        perror("alloc");
+        exit(1);
+    }
+    pthread_atfork(NULL, NULL, forget_inherited);
+}
+
+// counts what the worker still holds as leaked, once its connection is done
+void alloc_release(void) {
+
+    size_t i;
+
+    for (i = 0; i < table_size; i++) {
+        if (!table[i].ptr) continue;
+        atomic_fetch_sub(&table[i].site->live, table[i].size);
+        atomic_fetch_add(&table[i].site->leaked, table[i].size);
+    }
+    forget_inherited();
+}
+
+void *alloc_malloc(size_t size, const char *file, int line, const char *function) {
+
+    void *ptr = malloc(size);
+    track(ptr, size, file, line, function);
+    return ptr;
+}
+
+void *alloc_calloc(size_t count, size_t size, const char *file, int line, const char *function) {
+
+    void *ptr = calloc(count, size);
+    track(ptr, count * size, file, line, function);
+    return ptr;
+}
+
+void *alloc_realloc(void *ptr, size_t size, const char *file, int line, const char *function) {
+
+    uintptr_t old = (uintptr_t)ptr;    // only looked up, never dereferenced
+    void *moved = realloc(ptr, size);
+
+    if (!moved && size) return NULL;
+    if (old) remove_block((void *)old);
+    track(moved, size, file, line, function);
+    return moved;
+}
+
+char *alloc_strdup(const char *s, const char *file, int line, const char *function) {
+
+    char *copy = strdup(s);
+    track(copy, strlen(s) + 1, file, line, function);
+    return copy;
+}
+
+void alloc_free(void *ptr) {
+
+    if (ptr) remove_block(ptr);
+    free(ptr);
+}
+
+static int compare_sites(const void *a, const void *b) {
+
+    const alloc_site *x = *(alloc_site * const *)a, *y = *(alloc_site * const *)b;
+    long long x_held = atomic_load(&x->live) + atomic_load(&x->leaked);
+    long long y_held = atomic_load(&y->live) + atomic_load(&y->leaked);
+
+    if (x_held != y_held) return x_held > y_held ? -1 : 1;
+    return atomic_load(&x->total) > atomic_load(&y->total) ? -1 : atomic_load(&x->total) < atomic_load(&y->total);
+}
+
+/*
+ * Writes the counters of every call site to 'path', the sites holding
+ * on to the most memory first. Commands are shown by their 'names'.
+ * The report is readable by the server's user only. Returns -1 if it
+ * cannot be written.
+ */
+int alloc_dump(const char *path, const char **names, int num_names) {
+
+    alloc_site *used[ALLOC_SITES];
+    FILE *out;
+    int i, n = 0;
+
+    if (!sites || !(out = create_private(path))) return -1;
+    for (i = 0; i < ALLOC_SITES; i++) {
+        if (atomic_load(&sites[i].state) == 2) used[n++] = &sites[i];
+    }
+    qsort(used, n, sizeof(alloc_site *), compare_sites);
+
+    fprintf(out, "%-12s %-40s %10s %14s %12s %12s\n", "command", "site", "calls", "total bytes",
+        "live bytes", "leaked bytes");
+    for (i = 0; i < n; i++) {
+        char where[256];
+        snprintf(where, sizeof(where), "%s:%d %s", used[i]->file, used[i]->line, used[i]->function);
+        fprintf(out, "%-12s %-40s %10lld %14lld %12lld %12lld\n",
+            used[i]->command >= 0 && used[i]->command < num_names ? names[used[i]->command] : "-", where,
+            (long long)atomic_load(&used[i]->calls), (long long)atomic_load(&used[i]->total),
+            (long long)atomic_load(&used[i]->live), (long long)atomic_load(&used[i]->leaked));
+    }
+    return fclose(out) == EOF ? -1 : 0;
+}
+
+#endif
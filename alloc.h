@@ -0,0 +1,56 @@
+/*
+ * File: alloc.h
+ */
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+/*
+ * Allocation accounting, built in with -DALLOC_ACCOUNTING (make
+ * ALLOC_ACCOUNTING=1). Files that include this header last have their
+ * malloc() family counted per call site and per command being handled;
+ * the report is written on SIGUSR2. Without it everything below is a
+ * no-op.
+ */
+
+#define ALLOC_REPORT "/tmp/cshttp-alloc.txt"
+
+#ifdef ALLOC_ACCOUNTING
+
+#include <stddef.h>
+
+#define ALLOC_SITES 1024                        // pairs of call site and command told apart
+
+extern int alloc_command;
+
+void alloc_init(void);
+void alloc_release(void);
+int alloc_dump(const char *path, const char **names, int num_names);
+
+void *alloc_malloc(size_t size, const char *file, int line, const char *function);
+void *alloc_calloc(size_t count, size_t size, const char *file, int line, const char *function);
+void *alloc_realloc(void *ptr, size_t size, const char *file, int line, const char *function);
+char *alloc_strdup(const char *s, const char *file, int line, const char *function);
+void alloc_free(void *ptr);
+
+#ifndef ALLOC_IMPLEMENTATION
+#define malloc(size) alloc_malloc(size, __FILE__, __LINE__, __func__)
+#define calloc(count, size) alloc_calloc(count, size, __FILE__, __LINE__, __func__)
+#define realloc(ptr, size) alloc_realloc(ptr, size, __FILE__, __LINE__, __func__)
+#define strdup(s) alloc_strdup(s, __FILE__, __LINE__, __func__)
+#define free(ptr) alloc_free(ptr)
+#endif
+
+// what is allocated from now on is charged to 'command', NOTA for the connection itself
+#define alloc_attribute(command) (alloc_command = (command))
+
+#else
+
+#define alloc_init() ((void)0)
+#define alloc_release() ((void)0)
+#define alloc_dump(path, names, num_names) 0
+#define alloc_attribute(command) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * File: broadcast.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "broadcast.h"
+#include "util.h"
+
+/*
+ * Server-sent events of the server time, for /servertime?stream=1. A
+ * worker answers the request with the first event and hands the
+ * connection to the broadcaster, a process of its own, and is done.
+ * Once a second the broadcaster formats the time once and writes the
+ * same event to every subscriber. A subscriber that cannot take all of
+ * it right away is dropped: it reconnects after BROADCAST_RETRY, as a
+ * client of an event stream does.
+ */
+
+static int channel = -1;    // where workers send their connections
+
+static void add_subscribers(int receiver, int **subscribers, int *num, int *max) {
+
+    char control[CMSG_SPACE(sizeof(int))];
+    char byte;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t received;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        received = recvmsg(receiver, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (received == 0) {
+            // the server and all its workers are gone
+            exit(0);
+        }
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        if (*num == *max) {
+            *max = *max ? *max * 2 : 256;
+            *subscribers = realloc(*subscribers, *max * sizeof(int));
+        }
+        memcpy(&(*subscribers)[(*num)++], CMSG_DATA(cmsg), sizeof(int));
+    }
+}
+
+static int64_t realtime_ms(void) {
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void run(int receiver) {
+
+    int *subscribers = NULL, num = 0, max = 0, i;
+    // tick on the second, as the clock the event shows does
+    int64_t tick = realtime_ms() / 1000 * 1000 + 1000;
+
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    for (;;) {
+        struct pollfd pfd = {receiver, POLLIN, 0};
+        int64_t now = realtime_ms();
+
+        if (now < tick) {
+            if (poll(&pfd, 1, tick - now) > 0) {
+                add_subscribers(receiver, &subscribers, &num, &max);
+            }
+            continue;
+        }
+        tick = now / 1000 * 1000 + 1000;
+
+        time_t raw_time = now / 1000;
+        char *event = broadcast_event(&raw_time, 0);
+        size_t len = strlen(event);
+        for (i = 0; i < num; ) {
+            if (send(subscribers[i], event, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len) {
+                i++;
+                continue;
+            }
+            close(subscribers[i]);
+            subscribers[i] = subscribers[--num];
+        }
+        free(event);
+    }
+}
+
+/*
+ * Starts the broadcaster. Must be called before the first fork(), and
+ * before the listening sockets are opened so that it does not hold on
+ * to them. Returns -1 if it cannot be started, streams then end after
+ * their first event.
+ */
+int broadcast_init(void) {
+
+    int pair[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+        perror("broadcast");
+        return -1;
+    }
+    if ((pid = fork()) == -1) {
+        perror("broadcast");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pair[1]);
+        run(pair[0]);
+    }
+    close(pair[0]);
+    channel = pair[1];
+    return 0;
+}
+
+int broadcast_ready(void) {
+
+    return channel != -1;
+}
+
+/*
+ * Passes 'socket', whose response headers have been sent, on to the
+ * broadcaster. The caller closes its own copy. Returns -1 if it could
+ * not be passed on.
+ */
+int broadcast_subscribe(int socket) {
+
+    char control[CMSG_SPACE(sizeof(int))];
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    if (channel == -1) return -1;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &socket, sizeof(int));
+
+    return sendmsg(channel, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == 1 ? 0 : -1;
+}
+
+/*
+ * The event for 'raw_time'. The 'first' of a stream also tells the
+ * client how soon to reconnect. The string is the caller's.
+ */
+char *broadcast_event(time_t *raw_time, int first) {
+
+    char *time_string = get_local_time_string(raw_time);
+    char *event = malloc(strlen(time_string) + 32);
+
+    if (first) {
+        sprintf(event, "retry: %d\ndata: %s\n\n", BROADCAST_RETRY, time_string);
+    } else {
+        sprintf(event, "data: %s\n\n", time_string);
+    }
+    free(time_string);
+    return event;
+}
@@ -0,0 +1,17 @@
+/*
+ * File: broadcast.h
+ */
+
+#ifndef _BROADCAST_H_
+#define _BROADCAST_H_
+
+#include <time.h>
+
+#define BROADCAST_RETRY 1000    // milliseconds a client waits to reconnect to a stream
+
+int broadcast_init(void);
+int broadcast_ready(void);
+int broadcast_subscribe(int socket);
+char *broadcast_event(time_t *raw_time, int first);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * File: bufpool.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "bufpool.h"
+
+/*
+ * Receive buffers, shared by the workers of an acceptor. The acceptor
+ * maps the pool before it forks them, and with --cpus it does so after
+ * it has been pinned, so that the pool is local to its node. Workers
+ * borrow a slab only while a request is being received, so memory
+ * follows the number of active requests rather than the number of
+ * open connections. Free slabs are kept on a lock-free stack whose
+ * head carries a tag against ABA. Slabs still owned by a worker that
+ * died are given back when it is reaped. While the pool is empty,
+ * callers fall back to malloc.
+ */
+
+#define HUGE_PAGE (2*1024*1024)
+
+typedef struct pool_control {
+    _Atomic uint64_t head;      // tag << 32 | (index + 1) of the top slab, 0 when empty
+    uint32_t *next;             // per slab, index + 1 of the slab below it
+    _Atomic pid_t *owner;       // per slab, the worker holding it
+} pool_control;
+
+bufpool_config bufpool_conf = {
+    32*1024,    // slab_size
+    4096,       // slabs
+    0           // hugepages
+};
+
+static pool_control *pool;
+static char *slabs;
+static size_t region_size;
+
+static void *map_shared(size_t size, int flags) {
+
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | flags, -1, 0);
+}
+
+static void push(uint32_t index) {
+
+    uint64_t old = atomic_load(&pool->head), new;
+    do {
+        pool->next[index] = old & 0xffffffff;
+        new = ((old >> 32) + 1) << 32 | (index + 1);
+    } while (!atomic_compare_exchange_weak(&pool->head, &old, new));
+}
+
+static int pop(void) {
+
+    uint64_t old = atomic_load(&pool->head), new;
+    uint32_t top;
+    do {
+        top = old & 0xffffffff;
+        if (!top) return -1;
+        new = ((old >> 32) + 1) << 32 | pool->next[top - 1];
+    } while (!atomic_compare_exchange_weak(&pool->head, &old, new));
+    return top - 1;
+}
+
+// must be called before the first worker is forked so that they all share the pool
+void bufpool_init(void) {
+
+    size_t control_size = sizeof(pool_control) + bufpool_conf.slabs * (sizeof(uint32_t) + sizeof(pid_t));
+    int i;
+
+    if (bufpool_conf.slabs <= 0) return;
+
+    region_size = bufpool_conf.slab_size * bufpool_conf.slabs;
+    if (bufpool_conf.hugepages) {
+        region_size = (region_size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+        slabs = map_shared(region_size, MAP_HUGETLB);
+        if (slabs == MAP_FAILED) {
+            // no huge pages reserved: let transparent huge pages back it where they can
+            slabs = map_shared(region_size, 0);
+            if (slabs != MAP_FAILED) madvise(slabs, region_size, MADV_HUGEPAGE);
+        }
+    } else {
+        slabs = map_shared(region_size, 0);
+    }
+    pool = map_shared(control_size, 0);
+    if (slabs == MAP_FAILED || pool == MAP_FAILED) {
+        perror("bufpool");
+        exit(1);
+    }
+
+    pool->next = (uint32_t *)(pool + 1);
+    pool->owner = (_Atomic pid_t *)(pool->next + bufpool_conf.slabs);
+    for (i = bufpool_conf.slabs - 1; i >= 0; i--) push(i);
+}
+
+/*
+ * Returns the slabs 'worker' exited without giving back. Called by
+ * whoever reaps it, from a SIGCHLD handler too.
+ */
+void bufpool_release(pid_t worker) {
+
+    int i;
+
+    if (!pool) return;
+    for (i = 0; i < bufpool_conf.slabs; i++) {
+        pid_t owner = worker;
+        if (atomic_compare_exchange_strong(&pool->owner[i], &owner, 0)) push(i);
+    }
+}
+
+/*
+ * Borrows a slab of bufpool_conf.slab_size bytes. If the pool is
+ * exhausted the buffer comes from malloc instead; bufpool_put() takes
+ * either.
+ */
+char *bufpool_get(void) {
+
+    int index;
+
+    if (!pool) return malloc(bufpool_conf.slab_size);
+
+    index = pop();
+    if (index == -1) return malloc(bufpool_conf.slab_size);
+
+    atomic_store(&pool->owner[index], getpid());
+    return slabs + (size_t)index * bufpool_conf.slab_size;
+}
+
+int bufpool_owns(const char *buffer) {
+
+    return pool && buffer >= slabs && buffer < slabs + region_size;
+}
+
+void bufpool_put(char *slab) {
+
+    if (!bufpool_owns(slab)) {
+        free(slab);
+        return;
+    }
+    uint32_t index = (slab - slabs) / bufpool_conf.slab_size;
+    atomic_store(&pool->owner[index], 0);
+    push(index);
+}
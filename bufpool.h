@@ -0,0 +1,25 @@
+/*
+ * File: bufpool.h
+ */
+
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct bufpool_config {
+    size_t slab_size;       // bytes in a receive buffer
+    int slabs;              // buffers in the pool, shared by every worker
+    int hugepages;          // back the pool with huge pages if possible
+} bufpool_config;
+
+extern bufpool_config bufpool_conf;
+
+void bufpool_init(void);
+char *bufpool_get(void);
+void bufpool_put(char *slab);
+int bufpool_owns(const char *buffer);
+void bufpool_release(pid_t worker);
+
+#endif
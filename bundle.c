@@ -0,0 +1,142 @@
+/*
+ * File: bundle.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+
+/*
+ * Assets packed ahead of time by cspack. The bundle is mapped once by
+ * the parent and inherited by every worker, which serve hits straight
+ * out of the mapping without touching the file system.
+ */
+
+static const char *base;
+static size_t size;
+static const bundle_header *header;
+static const bundle_asset *slots;
+
+uint64_t bundle_hash(const char *path, size_t len) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    return hash ? hash : 1;    // 0 marks an empty slot
+}
+
+// true if the string at 'offset' ends within the mapping
+static int string_valid(uint64_t offset) {
+
+    return offset < size && memchr(base + offset, '\0', size - offset) != NULL;
+}
+
+// true if every offset in 'asset' stays within the mapping, and every string ends in it;
+// a length is checked against what is left past its offset, so that no sum can wrap
+static int asset_valid(const bundle_asset *asset) {
+
+    int i;
+
+    if (asset->path >= size || asset->path_len >= size - asset->path ||
+        !string_valid(asset->last_modified) || !string_valid(asset->content_type)) return 0;
+    for (i = 0; i < BUNDLE_VARIANTS; i++) {
+        const bundle_variant *v = &asset->variants[i];
+        if (i != BUNDLE_IDENTITY && !v->length) continue;
+        if (v->body > size || v->length > size - v->body || v->headers > size || v->headers_len > size - v->headers ||
+            !string_valid(v->etag) || !string_valid(v->content_length)) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Maps the bundle at 'path' for bundle_lookup(). Must be called before
+ * the first fork() so that the workers share the mapping. Returns -1 if
+ * it cannot be read or was not written by cspack.
+ */
+int bundle_open(const char *path) {
+
+    struct stat st;
+    uint32_t i, used = 0;
+    int fd;
+    void *mapping;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1) {
+        perror("bundle");
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(bundle_header)) {
+        fprintf(stderr, "bundle: %s is not an asset bundle\n", path);
+        close(fd);
+        return -1;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("bundle");
+        return -1;
+    }
+
+    base = mapping;
+    size = st.st_size;
+    header = mapping;
+    slots = (const bundle_asset *)(base + sizeof(bundle_header));
+    if (header->magic != BUNDLE_MAGIC || header->version != BUNDLE_VERSION || !header->num_slots ||
+        (header->num_slots & (header->num_slots - 1)) ||
+        header->num_slots > (size - sizeof(bundle_header)) / sizeof(bundle_asset)) {
+        fprintf(stderr, "bundle: %s is not an asset bundle\n", path);
+        goto invalid;
+    }
+    for (i = 0; i < header->num_slots; i++) {
+        if (slots[i].hash) used++;
+    }
+    // a full table would leave lookups of missing paths probing forever
+    for (i = 0; i < header->num_slots && used < header->num_slots; i++) {
+        if (slots[i].hash && !asset_valid(&slots[i])) break;
+    }
+    if (i < header->num_slots) {
+        fprintf(stderr, "bundle: %s is damaged\n", path);
+        goto invalid;
+    }
+    return 0;
+
+invalid:
+    munmap(mapping, size);
+    base = NULL;
+    header = NULL;
+    return -1;
+}
+
+/*
+ * Finds the asset packed under 'path', which is compared as it is, the
+ * way it would be opened. Returns NULL if there is none or no bundle.
+ */
+const bundle_asset *bundle_lookup(const char *path) {
+
+    size_t len;
+    uint64_t hash;
+    uint32_t i, mask;
+
+    if (!header) return NULL;
+    len = strlen(path);
+    hash = bundle_hash(path, len);
+    mask = header->num_slots - 1;
+    for (i = hash & mask; slots[i].hash; i = (i + 1) & mask) {
+        if (slots[i].hash == hash && slots[i].path_len == len && !memcmp(base + slots[i].path, path, len)) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+// the string or body at 'offset' in the bundle, as found in a bundle_asset
+const char *bundle_at(uint64_t offset) {
+
+    return base + offset;
+}
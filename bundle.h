@@ -0,0 +1,54 @@
+/*
+ * File: bundle.h
+ */
+
+#ifndef _BUNDLE_H_
+#define _BUNDLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUNDLE_MAGIC 0x4b435043     // "CPCK"
+#define BUNDLE_VERSION 1
+
+/*
+ * An asset bundle, as written by cspack: this header, then a hash table
+ * of 'num_slots' assets keyed by path, then the bodies, then the
+ * strings the assets refer to. Offsets count from the start of the
+ * bundle.
+ */
+typedef struct bundle_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;         // a power of two, at least twice the assets
+    uint32_t num_assets;
+} bundle_header;
+
+// one representation of an asset, as sent
+typedef struct bundle_variant {
+    uint64_t body;
+    uint64_t length;
+    uint64_t headers;           // HTTP/1.1 fields after Date and Connection, up to the blank line
+    uint64_t headers_len;
+    uint64_t etag;              // the values below are NUL-terminated strings
+    uint64_t content_length;
+} bundle_variant;
+
+enum { BUNDLE_IDENTITY, BUNDLE_GZIP, BUNDLE_VARIANTS };
+
+typedef struct bundle_asset {
+    uint64_t hash;              // of the path, 0 for an empty slot
+    uint64_t path;
+    uint64_t path_len;
+    int64_t mtime;
+    uint64_t last_modified;
+    uint64_t content_type;
+    bundle_variant variants[BUNDLE_VARIANTS];    // the gzip one has length 0 if it was not worth it
+} bundle_asset;
+
+uint64_t bundle_hash(const char *path, size_t len);
+int bundle_open(const char *path);
+const bundle_asset *bundle_lookup(const char *path);
+const char *bundle_at(uint64_t offset);
+
+#endif
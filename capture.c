@@ -0,0 +1,97 @@
+/*
+ * File: capture.c
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "capture.h"
+#include "util.h"
+
+/*
+ * Traffic capture for csreplay. Every worker appends the raw request
+ * bytes of its connection to one file, a record per read. O_APPEND
+ * keeps each record in one piece, as it is written with a single
+ * writev(). Connection numbers come from a counter shared by all
+ * processes, set up before the first fork().
+ */
+
+static int capture_fd = -1;
+static atomic_ullong *next_connection;
+
+/*
+ * Opens 'path' for appending, must be called before the first fork().
+ * A file that already holds a capture is refused: its times were taken
+ * by an earlier run, maybe on another boot, and do not line up with
+ * ours.
+ */
+int capture_init(const char *path) {
+
+    uint32_t header[2] = {CAPTURE_MAGIC, CAPTURE_VERSION};
+    struct stat st;
+
+    next_connection = mmap(NULL, sizeof(atomic_ullong), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (next_connection == MAP_FAILED) {
+        perror("capture");
+        return -1;
+    }
+    // it holds cookies, bodies and decrypted TLS, so it is the server's alone
+    if ((capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) == -1 ||
+        fstat(capture_fd, &st) == -1) {
+        perror(path);
+        if (capture_fd != -1) close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    if (st.st_size) {
+        fprintf(stderr, "capture: %s is not empty\n", path);
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    if (((st.st_mode & 077) && fchmod(capture_fd, 0600) == -1) ||
+        write(capture_fd, header, sizeof(header)) != sizeof(header)) {
+        perror(path);
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void record(capture_type type, uint64_t connection, const char *data, size_t length) {
+
+    capture_record r = {type, length, connection, monotonic_ns()};
+    struct iovec iov[2] = {{&r, sizeof(r)}, {(void *)data, length}};
+
+    // a lost record only makes the capture less complete
+    if (writev(capture_fd, iov, length ? 2 : 1) == -1) {
+        perror("capture");
+    }
+}
+
+// numbers a new connection and records it, returns 0 when not capturing
+uint64_t capture_open(void) {
+
+    uint64_t connection;
+
+    if (capture_fd == -1) return 0;
+    connection = atomic_fetch_add(next_connection, 1) + 1;
+    record(CAPTURE_OPEN, connection, NULL, 0);
+    return connection;
+}
+
+void capture_data(uint64_t connection, const char *data, size_t length) {
+
+    if (connection) record(CAPTURE_DATA, connection, data, length);
+}
+
+void capture_close(uint64_t connection) {
+
+    if (connection) record(CAPTURE_CLOSE, connection, NULL, 0);
+}
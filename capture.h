@@ -0,0 +1,37 @@
+/*
+ * File: capture.h
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_MAGIC 0x50414343    // "CCAP"
+#define CAPTURE_VERSION 1
+
+typedef enum {
+    CAPTURE_OPEN,       // the connection was accepted
+    CAPTURE_DATA,       // request bytes, as they were read
+    CAPTURE_CLOSE       // the connection was closed, by either side
+} capture_type;
+
+/*
+ * A capture file is CAPTURE_MAGIC and CAPTURE_VERSION as two 32-bit
+ * words, then one record per event, each followed by 'length' bytes.
+ * Workers append concurrently, so records are only roughly in order.
+ */
+typedef struct capture_record {
+    uint32_t type;
+    uint32_t length;
+    uint64_t connection;    // unique within the capture
+    int64_t time;           // monotonic_ns() when it happened
+} capture_record;
+
+int capture_init(const char *path);
+uint64_t capture_open(void);
+void capture_data(uint64_t connection, const char *data, size_t length);
+void capture_close(uint64_t connection);
+
+#endif
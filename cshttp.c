@@ -14,92 +14,464 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <getopt.h>
+#include <poll.h>
 
 #include "service.h"
+#include "filecache.h"
+#include "listener.h"
+#include "admission.h"
+#include "placement.h"
+#include "bufpool.h"
+#include "trace.h"
+#include "orders.h"
+#include "bundle.h"
+#include "tls.h"
+#include "capture.h"
+#include "memo.h"
+#include "broadcast.h"
+#include "alloc.h"
 
-#define BACKLOG 10   // how many pending connections queue will hold
+static const char *handoff_path;
+static int drain_timeout = 30;
+static const char *orders_path = "ORDERS.db";
+static const char *bundle_path;
+static const char *capture_path;
+
+// workers still running, kept up to date by the SIGCHLD handler
+static pid_t *children;
+static volatile sig_atomic_t num_children;
+static int max_children;
+static int accepting;   // our children are workers, not acceptors
 
 static void sigchld_handler(int s) {
     
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+    int saved_errno = errno, i;
+    pid_t pid;
+
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        admission_release(pid);
+        bufpool_release(pid);
+        for (i = 0; i < num_children; i++) {
+            if (children[i] == pid) {
+                if (accepting) admission_connection_closed();
+                children[i] = children[--num_children];
+                break;
+            }
+        }
+    }
+    errno = saved_errno;
 }
 
-// get sockaddr, IPv4 or IPv6:
-static void *get_in_addr(struct sockaddr *sa) {
+// signals every worker still running, with SIGCHLD held off meanwhile
+static void signal_children(int sig) {
+
+    sigset_t mask, old;
+    int i;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    for (i = 0; i < num_children; i++) kill(children[i], sig);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+static void add_child(pid_t pid) {
+
+    sigset_t mask, old;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    if (num_children == max_children) {
+        max_children = max_children ? max_children * 2 : 64;
+        children = realloc(children, max_children * sizeof(pid_t));
+    }
+    children[num_children++] = pid;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Writes out the request trace as SIGUSR2 asked, and the allocation
+ * report when built with it, from a child so that accepting goes on
+ * meanwhile.
+ */
+static void dump_trace(void) {
+
+    pid_t pid;
+
+    trace_dump_requested = 0;
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        if (alloc_dump(ALLOC_REPORT, command_str, NOTA) == 0) {
+            printf("server: allocations written to %s\n", ALLOC_REPORT);
+            fflush(stdout);
+            if (!trace_conf.sample) _exit(0);
+        }
+        if (trace_dump(trace_conf.path) == -1) {
+            fprintf(stderr, "server: cannot write the trace to %s\n", trace_conf.path);
+            _exit(1);
+        }
+        printf("server: trace written to %s\n", trace_conf.path);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (pid == -1) perror("fork");
+}
+
+/*
+ * Stops accepting, lets the children finish what they are serving and
+ * exits. Children still busy after 'timeout' seconds are terminated.
+ * Used once the listening sockets belong to a successor, or when told
+ * to with SIGUSR1.
+ */
+static void drain(int *sockets, int num_sockets, int handoff_socket, int timeout) {
+
+    int64_t deadline = monotonic_ns() + (int64_t)timeout * 1000000000;
+    int i;
+
+    for (i = 0; i < num_sockets; i++) close(sockets[i]);
+    if (handoff_socket != -1) close(handoff_socket);
+    printf("server: draining %d connections\n", (int)num_children);
+    fflush(stdout);
+
+    signal_children(SIGUSR1);
+    while (num_children && monotonic_ns() < deadline) {
+        poll(NULL, 0, 100);
+    }
+    signal_children(SIGTERM);
+
+    accesslog_shutdown();
+    exit(0);
+}
+
+static void usage(const char *prog) {
     
-    if (sa->sa_family == AF_INET)
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    else
-        return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    fprintf(stderr, "Usage:\n\t%s [options] PORTNUMBER|unix:PATH\n"
+            "Options:\n"
+            "\t--idle-timeout SECS   close keep-alive connections idle this long (0: never)\n"
+            "\t--max-requests N      close a connection after N requests (0: unlimited)\n"
+            "\t--max-lifetime SECS   close a connection this long after it opened (0: never)\n"
+            "\t--cache-dir DIR       where compressed copies of served files are kept\n"
+            "\t--no-cache            do not compress files on the fly\n"
+            "\t--backlog N           length of the queue of connections not yet accepted\n"
+            "\t--defer-accept SECS   wait this long for a request before accepting (0: off)\n"
+            "\t--no-nodelay          leave Nagle's algorithm enabled on client sockets\n"
+            "\t--fastopen N          TCP Fast Open queue length (0: off)\n"
+            "\t--handoff PATH        take over from / hand over to a server at this Unix socket\n"
+            "\t--drain-timeout SECS  how long connections may take to finish after a handoff\n"
+            "\t--max-connections N   refuse connections while N are being served (0: no limit)\n"
+            "\t--max-inflight N      refuse requests while N are being handled (0: no limit)\n"
+            "\t--max-queue-delay MS  refuse connections while requests wait longer than this (0: no limit)\n"
+            "\t--rate-limit N        requests per second allowed to each client address (0: no limit)\n"
+            "\t--rate-burst N        requests a client may make at once (default: the rate limit)\n"
+            "\t--expensive-cost N    how many requests a /getfile(s) or /putfile counts for\n"
+            "\t--cpus LIST           run an acceptor pinned to each CPU in LIST (e.g. 0-3,8 or all)\n"
+            "\t--incoming-cpu        steer connections to the acceptor of the CPU they arrive on\n"
+            "\t--buffer-size BYTES   size of a receive buffer, larger requests use the heap\n"
+            "\t--buffers N           receive buffers for each acceptor's connections (0: use the heap)\n"
+            "\t--huge-pages          back the receive buffers with huge pages\n"
+            "\t--trace-sample N      trace the phases of one request in N (0: off), dump with SIGUSR2\n"
+            "\t--trace-file PATH     where the trace is dumped, as Chrome trace JSON\n"
+            "\t--trace-events N      events kept per worker\n"
+            "\t--orders-file PATH    where checkouts are stored\n"
+            "\t--bundle PATH         serve /getfile from an asset bundle made by cspack\n"
+            "\t--tls-cert PATH       serve HTTPS with this PEM certificate chain\n"
+            "\t--tls-key PATH        its private key (default: in the certificate file)\n"
+            "\t--capture PATH        record the raw requests in PATH, new or empty, for csreplay\n"
+            "\t--memo-entries N      /browser and /redirect responses kept for reuse (0: off)\n"
+            "\t--unix-mode MODE      permissions of the unix:PATH socket, in octal (default: 660)\n",
+            prog);
+    exit(1);
 }
 
-static int create_server_socket(char *port) {
+// parse the command line options and return the port to listen on
+static char *parse_options(int argc, char *argv[]) {
     
-    int lst_socket;
-    struct addrinfo hints, *servinfo, *p;
-    int yes = 1;
-    int rv;
+    static const struct option options[] = {
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"max-requests", required_argument, NULL, 'n'},
+        {"max-lifetime", required_argument, NULL, 'l'},
+        {"cache-dir", required_argument, NULL, 'c'},
+        {"no-cache", no_argument, NULL, 'C'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"defer-accept", required_argument, NULL, 'd'},
+        {"no-nodelay", no_argument, NULL, 'N'},
+        {"fastopen", required_argument, NULL, 'f'},
+        {"handoff", required_argument, NULL, 'H'},
+        {"drain-timeout", required_argument, NULL, 'D'},
+        {"max-connections", required_argument, NULL, 'm'},
+        {"max-inflight", required_argument, NULL, 'I'},
+        {"max-queue-delay", required_argument, NULL, 'q'},
+        {"rate-limit", required_argument, NULL, 'r'},
+        {"rate-burst", required_argument, NULL, 'B'},
+        {"expensive-cost", required_argument, NULL, 'e'},
+        {"cpus", required_argument, NULL, 'P'},
+        {"incoming-cpu", no_argument, NULL, 'S'},
+        {"buffer-size", required_argument, NULL, 'z'},
+        {"buffers", required_argument, NULL, 'u'},
+        {"huge-pages", no_argument, NULL, 'g'},
+        {"trace-sample", required_argument, NULL, 't'},
+        {"trace-file", required_argument, NULL, 'T'},
+        {"trace-events", required_argument, NULL, 'E'},
+        {"orders-file", required_argument, NULL, 'o'},
+        {"bundle", required_argument, NULL, 'a'},
+        {"tls-cert", required_argument, NULL, 'x'},
+        {"tls-key", required_argument, NULL, 'k'},
+        {"capture", required_argument, NULL, 'w'},
+        {"memo-entries", required_argument, NULL, 'M'},
+        {"unix-mode", required_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *cache_dir = "/tmp/cshttp-cache";
+    int opt;
     
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE; // use my IP
-
-    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        exit(1);
+    while ((opt = getopt_long(argc, argv, "i:n:l:c:Cb:d:Nf:H:D:m:I:q:r:B:e:P:Sz:u:gt:T:E:o:a:x:k:w:M:U:", options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': service_conf.idle_timeout = atoi(optarg) * 1000; break;
+            case 'n': service_conf.max_requests = atoi(optarg); break;
+            case 'l': service_conf.max_lifetime = atoi(optarg) * 1000; break;
+            case 'c': cache_dir = optarg; break;
+            case 'C': cache_dir = NULL; break;
+            case 'b': listener_conf.backlog = atoi(optarg); break;
+            case 'd': listener_conf.defer_accept = atoi(optarg); break;
+            case 'N': listener_conf.nodelay = 0; break;
+            case 'f': listener_conf.fastopen = atoi(optarg); break;
+            case 'H': handoff_path = optarg; break;
+            case 'D': drain_timeout = atoi(optarg); break;
+            case 'm': admission_conf.max_connections = atoi(optarg); break;
+            case 'I': admission_conf.max_inflight = atoi(optarg); break;
+            case 'q': admission_conf.max_queue_delay = atoi(optarg); break;
+            case 'r': admission_conf.rate_limit = atoi(optarg); break;
+            case 'B': admission_conf.rate_burst = atoi(optarg); break;
+            case 'e': admission_conf.expensive_cost = atoi(optarg); break;
+            case 'P':
+                if (placement_parse(optarg) == -1) {
+                    fprintf(stderr, "Invalid CPU list: %s. ", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'S': placement_conf.incoming_cpu = 1; break;
+            case 'z':
+                bufpool_conf.slab_size = atoi(optarg);
+                if (bufpool_conf.slab_size < 1024) {
+                    fprintf(stderr, "Buffer size must be at least 1024 bytes. ");
+                    usage(argv[0]);
+                }
+                break;
+            case 'u': bufpool_conf.slabs = atoi(optarg); break;
+            case 'g': bufpool_conf.hugepages = 1; break;
+            case 'o': orders_path = optarg; break;
+            case 'a': bundle_path = optarg; break;
+            case 'x': tls_conf.cert = optarg; break;
+            case 'k': tls_conf.key = optarg; break;
+            case 'w': capture_path = optarg; break;
+            case 'M': memo_conf.entries = atoi(optarg); break;
+            case 'U': listener_conf.unix_mode = strtol(optarg, NULL, 8) & 0777; break;
+            case 't': trace_conf.sample = atoi(optarg); break;
+            case 'T': trace_conf.path = optarg; break;
+            case 'E':
+                trace_conf.events = atoi(optarg);
+                if (trace_conf.events < 1) {
+                    fprintf(stderr, "Invalid number of trace events: %s. ", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    filecache_init(cache_dir);
+    
+    if (optind >= argc) {
+        fprintf(stderr, "Port was not specified. ");
+        usage(argv[0]);
     }
+    return argv[optind];
+}
 
-    // loop through all the results and bind to the first we can
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((lst_socket = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("server: socket");
-            continue;
+/*
+ * Accepts connections on 'sockets' and forks a worker for each, until
+ * the sockets are handed over or the process is told to drain.
+ */
+static void accept_loop(int *sockets, int num_sockets, int handoff_socket) {
+
+    accepted batch[LISTENER_BATCH];
+    sigset_t chld, unblocked;
+
+    accepting = 1;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    while(1) {  // main accept() loop
+        struct pollfd pfds[LISTENER_MAX_HANDOFF + 1];
+        int i, j, n;
+
+        if (service_draining) {
+            drain(sockets, num_sockets, handoff_socket, drain_timeout);
+        }
+        if (trace_dump_requested) {
+            dump_trace();
         }
 
-        if (setsockopt(lst_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-            perror("setsockopt");
-            exit(1);
+        for (j = 0; j < num_sockets; j++) {
+            pfds[j].fd = sockets[j];
+            pfds[j].events = POLLIN;
         }
+        pfds[num_sockets].fd = handoff_socket;  // ignored by poll() when -1
+        pfds[num_sockets].events = POLLIN;
 
-        if (bind(lst_socket, p->ai_addr, p->ai_addrlen) == -1) {
-            close(lst_socket);
-            perror("server: bind");
+        if (poll(pfds, num_sockets + 1, -1) == -1) {
+            if (errno != EINTR) perror("poll");
             continue;
         }
 
-        break;
-    }
+        if ((pfds[num_sockets].revents & POLLIN) &&
+            listener_handoff_send(handoff_socket, sockets, num_sockets) == 0) {
+            drain(sockets, num_sockets, handoff_socket, drain_timeout);
+        }
 
-    if (p == NULL)  {
-        fprintf(stderr, "server: failed to bind\n");
-        exit(2);
+        for (j = 0; j < num_sockets; j++) {
+            if (!(pfds[j].revents & POLLIN)) continue;
+
+            // a burst is taken off the queue at once, instead of one per wakeup
+            n = listener_accept(sockets[j], batch, LISTENER_BATCH);
+            for (i = 0; i < n; i++) {
+                int clt_socket = batch[i].socket;
+                log_peer peer = batch[i].peer;
+                pid_t pid;
+                accesslog_write(LOG_CONNECT, &peer, NOTA, 0, 0, 0);
+
+                // shed before paying for a fork, the answer is ready made
+                if (admission_overloaded()) {
+                    char discard[4096];
+                    size_t len;
+                    const char *rejection = admission_response(ADMIT_SHED, &len);
+                    // unread request bytes would turn the close into a reset
+                    while (recv(clt_socket, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+                    ssize_t sent = send(clt_socket, rejection, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+                    accesslog_write(LOG_REQUEST, &peer, NOTA, 503, sent > 0 ? sent : 0, 0);
+                    close(clt_socket);
+                    continue;
+                }
+
+                // a worker gone before it is counted would never be counted out
+                sigprocmask(SIG_BLOCK, &chld, &unblocked);
+                if (!(pid = fork())) { // this is the child process
+                    // child doesn't need the listeners, nor the rest of the batch
+                    for (j = 0; j < num_sockets; j++) close(sockets[j]);
+                    if (handoff_socket != -1) close(handoff_socket);
+                    while (++i < n) close(batch[i].socket);
+                    // its helpers are reaped by task_loop_collect(), not by our handler
+                    signal(SIGCHLD, SIG_DFL);
+                    sigprocmask(SIG_SETMASK, &unblocked, NULL);
+                    accesslog_init();
+                    handle_client(clt_socket, &peer);
+                    alloc_release();
+                    close(clt_socket);
+                    accesslog_shutdown();
+                    exit(0);
+                }
+                if (pid > 0) {
+                    add_child(pid);
+                    admission_connection_opened();
+                }
+                sigprocmask(SIG_SETMASK, &unblocked, NULL);
+                close(clt_socket);  // parent doesn't need this
+            }
+        }
     }
-    
-    freeaddrinfo(servinfo); // all done with this structure
-    
-    if (listen(lst_socket, BACKLOG) == -1) {
-        perror("listen");
-        exit(1);
+}
+
+/*
+ * Forks an acceptor pinned to each configured CPU, then only waits for
+ * a successor or a signal to drain. Acceptor k serves every listener j
+ * with j % num_cpus == k, or shares listener k % num_sockets when
+ * there are fewer listeners than CPUs, e.g. after taking over from a
+ * server that ran with a single one.
+ */
+static void run_acceptors(int *sockets, int num_sockets, int handoff_socket) {
+
+    int k, j;
+
+    for (k = 0; k < placement_conf.num_cpus; k++) {
+        int cpu = placement_conf.cpus[k];
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            int own[LISTENER_MAX_HANDOFF], num_own = 0;
+
+            num_children = 0;   // the acceptors are the parent's children, not ours
+            placement_pin(cpu);
+            // a pool of its own, its pages local to the node its workers run on
+            bufpool_init();
+            if (handoff_socket != -1) close(handoff_socket);
+            for (j = 0; j < num_sockets; j++) {
+                int mine = num_sockets < placement_conf.num_cpus ?
+                    j == k % num_sockets : j % placement_conf.num_cpus == k;
+                if (mine) own[num_own++] = sockets[j];
+                else close(sockets[j]);
+            }
+            accesslog_init();
+            accept_loop(own, num_own, -1);
+        }
+        if (pid > 0) add_child(pid);
+        else perror("fork");
     }
 
-    return lst_socket;
+    while (1) {
+        struct pollfd pfd = {handoff_socket, POLLIN, 0};
+
+        if (service_draining) {
+            // give the acceptors time to terminate their own workers first
+            drain(sockets, num_sockets, handoff_socket, drain_timeout + 1);
+        }
+        if (trace_dump_requested) {
+            dump_trace();
+        }
+        if (poll(&pfd, 1, -1) == 1 && (pfd.revents & POLLIN) &&
+            listener_handoff_send(handoff_socket, sockets, num_sockets) == 0) {
+            drain(sockets, num_sockets, handoff_socket, drain_timeout + 1);
+        }
+    }
 }
 
 int main(int argc, char *argv[]) {
     
-    int lst_socket, clt_socket;
-    struct sockaddr_storage their_addr;
-    socklen_t sin_size;
+    int sockets[LISTENER_MAX_HANDOFF], num_sockets = -1;
+    int handoff_socket = -1;
     struct sigaction sa;
-    char s[INET6_ADDRSTRLEN];
+    char *port;
     
-    if (argc < 2) {
-        fprintf(stderr, "Port was not specified. Usage:\n\t%s PORTNUMBER\n", argv[0]);
+    port = parse_options(argc, argv);
+    broadcast_init();
+    // mapped once, every worker inherits it
+    if (bundle_path && bundle_open(bundle_path) == -1) {
+        exit(1);
+    }
+    if (tls_init() == -1) {
+        fprintf(stderr, "server: cannot use the certificate %s\n", tls_conf.cert);
+        exit(1);
+    }
+    if (handoff_path) {
+        num_sockets = listener_handoff_receive(handoff_path, sockets, LISTENER_MAX_HANDOFF);
+    }
+    if (num_sockets <= 0) {
+        // one listener per acceptor, the kernel spreads connections over them
+        // a Unix socket can only be bound once, its acceptors share it
+        int unix_socket = !strncmp(port, LISTENER_UNIX, strlen(LISTENER_UNIX));
+        int count = placement_conf.num_cpus && !unix_socket ? placement_conf.num_cpus : 1;
+        listener_conf.reuseport = count > 1;
+        for (num_sockets = 0; num_sockets < count; num_sockets++) {
+            sockets[num_sockets] = listener_open(port);
+            if (placement_conf.incoming_cpu && placement_conf.num_cpus && !unix_socket) {
+                placement_steer(sockets[num_sockets], placement_conf.cpus[num_sockets]);
+            }
+        }
+    } else {
+        printf("server: took over %d listening sockets from %s\n", num_sockets, handoff_path);
+    }
+    if (handoff_path) {
+        handoff_socket = listener_handoff_open(handoff_path);
     }
-    
-    lst_socket = create_server_socket(argv[1]);
-    if (lst_socket < 0) return 1;
     
     sa.sa_handler = sigchld_handler; // reap all dead processes
     sigemptyset(&sa.sa_mask);
@@ -108,27 +480,34 @@ int main(int argc, char *argv[]) {
         perror("sigaction");
         exit(1);
     }
+    // inherited by acceptors and workers, so they can be told to drain right after fork()
+    sa.sa_handler = service_drain;
+    sa.sa_flags = 0;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = trace_request_dump;
+    sigaction(SIGUSR2, &sa, NULL);
+    // sendfile() and OpenSSL write to clients that may be gone, that must not kill a worker
+    signal(SIGPIPE, SIG_IGN);
     
     printf("server: waiting for connections...\n");
+    fflush(stdout);
+    accesslog_init();
+    admission_init();
+    if (!placement_conf.num_cpus) bufpool_init();
+    trace_init();
+    memo_init();
+    alloc_init();
+    if (orders_init(orders_path) == -1) {
+        fprintf(stderr, "server: checkouts cannot be stored in %s\n", orders_path);
+    }
+    if (capture_path && capture_init(capture_path) == -1) {
+        fprintf(stderr, "server: traffic cannot be captured to %s\n", capture_path);
+    }
 
-    while(1) {  // main accept() loop
-        sin_size = sizeof(their_addr);
-        clt_socket = accept(lst_socket, (struct sockaddr *) &their_addr, &sin_size);
-        if (clt_socket == -1) {
-            perror("accept");
-            continue;
-        }
-        
-        inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), s, sizeof(s));
-        printf("server: got connection from %s\n", s);
-
-        if (!fork()) { // this is the child process
-            close(lst_socket); // child doesn't need the listener
-            handle_client(clt_socket);
-            close(clt_socket);
-            exit(0);
-        }
-        close(clt_socket);  // parent doesn't need this
+    if (placement_conf.num_cpus) {
+        run_acceptors(sockets, num_sockets, handoff_socket);
+    } else {
+        accept_loop(sockets, num_sockets, handoff_socket);
     }
 
     return 0;
@@ -0,0 +1,285 @@
+/*
+ * File: cspack.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "bundle.h"
+#include "filecache.h"
+#include "util.h"
+
+/*
+ * Packs the files under a directory into an asset bundle for the
+ * --bundle option of cshttp. Paths are stored the way they would be
+ * requested, relative to where the packer runs, so it should be run
+ * from the directory the server is started in:
+ *
+ *     cspack files assets.pack
+ *
+ * Each file is stored as it is and, when that comes out smaller,
+ * gzipped as well, both with their response headers rendered.
+ */
+
+typedef struct asset_file {
+    char *path;
+    struct stat st;
+    uint32_t slot;
+} asset_file;
+
+static asset_file *files;
+static int num_files, max_files;
+
+// the string table, written after the bodies
+static char *strings;
+static size_t strings_len, strings_max;
+
+static void add_file(const char *path, const struct stat *st) {
+
+    if (num_files == max_files) {
+        max_files = max_files ? max_files * 2 : 64;
+        files = realloc(files, max_files * sizeof(asset_file));
+    }
+    files[num_files].path = strdup(path);
+    files[num_files].st = *st;
+    num_files++;
+}
+
+// collects the regular files under 'dir', following links to files but not to directories
+static void walk(const char *dir, const char *prefix) {
+
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+
+    if (!d) {
+        perror(dir);
+        exit(1);
+    }
+    while ((entry = readdir(d))) {
+        struct stat st;
+        char *path, *name;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+        name = malloc(strlen(prefix) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", dir, entry->d_name);
+        sprintf(name, "%s%s", prefix, entry->d_name);
+
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            strcat(name, "/");
+            walk(path, name);
+        } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            add_file(name, &st);
+        }
+        free(path);
+        free(name);
+    }
+    closedir(d);
+}
+
+// appends 'len' bytes to the string table, returning their offset from 'base'
+static uint64_t add_bytes(uint64_t base, const char *s, size_t len) {
+
+    uint64_t offset = base + strings_len;
+
+    if (strings_len + len > strings_max) {
+        strings_max = (strings_len + len) * 2;
+        strings = realloc(strings, strings_max);
+    }
+    memcpy(strings + strings_len, s, len);
+    strings_len += len;
+    return offset;
+}
+
+static uint64_t add_string(uint64_t base, const char *s) {
+
+    return add_bytes(base, s, strlen(s) + 1);
+}
+
+// gzips 'data' the way the file cache would, returning NULL if that does not make it smaller
+static char *gzip(const char *data, size_t len, size_t *gzip_len) {
+
+    z_stream zs;
+    char *out;
+
+    if (len < FILECACHE_MIN_SIZE) return NULL;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    *gzip_len = deflateBound(&zs, len);
+    out = malloc(*gzip_len);
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = *gzip_len;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= len) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *gzip_len = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+static char *read_file(const char *path, size_t len) {
+
+    FILE *in = fopen(path, "rb");
+    char *data = malloc(len ? len : 1);
+
+    if (!in || fread(data, 1, len, in) != len) {
+        perror(path);
+        exit(1);
+    }
+    fclose(in);
+    return data;
+}
+
+/*
+ * Renders the header fields the server sends along with one
+ * representation of 'file', whose body is already written.
+ */
+static void add_variant(bundle_variant *v, uint64_t base, const asset_file *file, const char *last_modified,
+        const char *encoding, int has_gzip) {
+
+    char etag[80], content_length[24];
+    char *headers = malloc(1);
+
+    // the same validator as build_etag(), so caches revalidate across a switch to the bundle
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx.%lx%s%s\"", (unsigned long)file->st.st_ino,
+        (unsigned long)file->st.st_size, (unsigned long)file->st.st_mtim.tv_sec,
+        (unsigned long)file->st.st_mtim.tv_nsec, encoding ? "-" : "", encoding ? encoding : "");
+    snprintf(content_length, sizeof(content_length), "%llu", (unsigned long long)v->length);
+
+    // in the order emit_response_headers() uses
+    *headers = '\0';
+    add_header_field(&headers, "Cache-Control", "public");
+    add_header_field(&headers, "Content-Length", content_length);
+    add_header_field(&headers, "Content-Type", "application/octet-stream");
+    add_header_field(&headers, "Last-Modified", last_modified);
+    add_header_field(&headers, "ETag", etag);
+    if (!encoding) add_header_field(&headers, "Accept-Ranges", "bytes");
+    if (encoding) add_header_field(&headers, "Content-Encoding", encoding);
+    if (has_gzip) add_header_field(&headers, "Vary", "Accept-Encoding");
+
+    append(&headers, "\n");
+
+    v->headers_len = strlen(headers);
+    v->headers = add_bytes(base, headers, v->headers_len);
+    v->etag = add_string(base, etag);
+    v->content_length = add_string(base, content_length);
+    free(headers);
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr, "Usage:\n\t%s DIRECTORY BUNDLE\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+    bundle_header header;
+    bundle_asset *slots;
+    uint64_t offset, base;
+    char *tmp_path, *prefix;
+    size_t dir_len;
+    FILE *out;
+    int i;
+
+    if (argc != 3) usage(argv[0]);
+
+    // "." packs paths as they are, anything else keeps the directory in front
+    dir_len = strlen(argv[1]);
+    while (dir_len > 1 && argv[1][dir_len - 1] == '/') argv[1][--dir_len] = '\0';
+    prefix = malloc(dir_len + 2);
+    if (!strcmp(argv[1], ".")) *prefix = '\0';
+    else sprintf(prefix, "%s/", argv[1]);
+    walk(argv[1], prefix);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = BUNDLE_MAGIC;
+    header.version = BUNDLE_VERSION;
+    header.num_assets = num_files;
+    header.num_slots = 2;
+    while (header.num_slots < 2 * (uint32_t)num_files) header.num_slots *= 2;
+    slots = calloc(header.num_slots, sizeof(bundle_asset));
+
+    tmp_path = malloc(strlen(argv[2]) + 5);
+    sprintf(tmp_path, "%s.tmp", argv[2]);
+    if (!(out = fopen(tmp_path, "wb"))) {
+        perror(tmp_path);
+        return 1;
+    }
+
+    // the bodies go right after the table, the strings after them
+    offset = sizeof(bundle_header) + header.num_slots * sizeof(bundle_asset);
+    if (fseek(out, offset, SEEK_SET) == -1) {
+        perror(tmp_path);
+        return 1;
+    }
+    for (i = 0; i < num_files; i++) {
+        asset_file *file = &files[i];
+        size_t len = file->st.st_size, gzip_len = 0;
+        char *data = read_file(file->path, len);
+        char *gzipped = gzip(data, len, &gzip_len);
+        uint64_t hash = bundle_hash(file->path, strlen(file->path));
+        bundle_asset *asset;
+
+        file->slot = hash & (header.num_slots - 1);
+        while (slots[file->slot].hash) file->slot = (file->slot + 1) & (header.num_slots - 1);
+        asset = &slots[file->slot];
+        asset->hash = hash;
+        asset->mtime = file->st.st_mtime;
+
+        if (fwrite(data, 1, len, out) != len || (gzipped && fwrite(gzipped, 1, gzip_len, out) != gzip_len)) {
+            perror(tmp_path);
+            return 1;
+        }
+        asset->variants[BUNDLE_IDENTITY].body = offset;
+        asset->variants[BUNDLE_IDENTITY].length = len;
+        offset += len;
+        if (gzipped) {
+            asset->variants[BUNDLE_GZIP].body = offset;
+            asset->variants[BUNDLE_GZIP].length = gzip_len;
+            offset += gzip_len;
+        }
+        free(data);
+        free(gzipped);
+    }
+
+    // the sizes of the gzipped bodies are known now, so are the headers
+    base = offset;
+    for (i = 0; i < num_files; i++) {
+        asset_file *file = &files[i];
+        bundle_asset *asset = &slots[file->slot];
+        bundle_variant *identity = &asset->variants[BUNDLE_IDENTITY], *gzipped = &asset->variants[BUNDLE_GZIP];
+        char *last_modified = get_gm_time_string(&file->st.st_mtime);
+
+        asset->path_len = strlen(file->path);
+        asset->path = add_string(base, file->path);
+        asset->last_modified = add_string(base, last_modified);
+        asset->content_type = add_string(base, "application/octet-stream");
+        add_variant(identity, base, file, last_modified, NULL, gzipped->length != 0);
+        if (gzipped->length) {
+            add_variant(gzipped, base, file, last_modified, "gzip", 1);
+        }
+        free(last_modified);
+    }
+
+    if (fwrite(strings, 1, strings_len, out) != strings_len || fseek(out, 0, SEEK_SET) == -1 ||
+        fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(slots, sizeof(bundle_asset), header.num_slots, out) != header.num_slots ||
+        fclose(out) == EOF || rename(tmp_path, argv[2]) == -1) {
+        perror(argv[2]);
+        unlink(tmp_path);
+        return 1;
+    }
+    printf("%s: %d assets, %llu bytes\n", argv[2], num_files, (unsigned long long)(base + strings_len));
+    return 0;
+}
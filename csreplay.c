@@ -0,0 +1,345 @@
+/*
+ * File: csreplay.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "capture.h"
+#include "util.h"
+
+/*
+ * Replays traffic captured with cshttp --capture against a server. Each
+ * captured connection is opened, fed the bytes it sent when it sent
+ * them, and closed in the same order, so pipelining and keep-alive
+ * look as they did. Responses are read and counted but not checked.
+ *
+ *     csreplay --speed 4 capture.bin 8080
+ */
+
+#define DRAIN_TIMEOUT 5000      // milliseconds left for responses after the last event
+
+typedef struct event {
+    capture_type type;
+    int connection;             // index into conns
+    int64_t time;
+    const char *data;
+    size_t length;
+    size_t order;               // in the file, to keep events at the same time in order
+} event;
+
+typedef struct replay_conn {
+    int fd;                     // -1 before it is opened and once it is closed
+    int connecting;
+    int closing;                // all it sent is queued, shut down once written
+    int shut;
+    char *out;                  // bytes due that the socket has not taken yet
+    size_t out_len, out_sent;
+    uint64_t received;
+} replay_conn;
+
+static event *events;
+static size_t num_events, max_events;
+static replay_conn *conns;
+static int num_conns, open_conns;
+static struct addrinfo *server;
+
+static uint64_t bytes_sent, bytes_received, late_events;
+static int64_t max_lag;
+static int failed_conns;
+
+static int compare_events(const void *a, const void *b) {
+
+    const event *x = a, *y = b;
+
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void add_event(capture_type type, int connection, int64_t time, const char *data, size_t length) {
+
+    if (num_events == max_events) {
+        max_events = max_events ? max_events * 2 : 1024;
+        events = realloc(events, max_events * sizeof(event));
+    }
+    events[num_events].type = type;
+    events[num_events].connection = connection;
+    events[num_events].time = time;
+    events[num_events].data = data;
+    events[num_events].length = length;
+    events[num_events].order = num_events;
+    num_events++;
+}
+
+/*
+ * Reads the capture at 'path' into events, each captured connection
+ * becoming 'copies' replayed ones. Connection numbers start over when
+ * the server is restarted, so an open always starts a new connection.
+ */
+static void load(const char *path, int copies) {
+
+    struct stat st;
+    const char *p, *end;
+    const uint32_t *header;
+    int fd = open(path, O_RDONLY);
+    int *slots = NULL, max_slots = 0, i;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+    p = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    header = (const uint32_t *)p;
+    if (p == MAP_FAILED || st.st_size < 8 || header[0] != CAPTURE_MAGIC || header[1] != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        exit(1);
+    }
+    end = p + st.st_size;
+
+    for (p += 8; p + sizeof(capture_record) <= end; ) {
+        capture_record r;
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+        if (r.length > (size_t)(end - p)) break;    // cut short while it was written
+
+        if (r.connection >= (uint64_t)max_slots) {
+            int n = max_slots;
+            max_slots = r.connection * 2 + 16;
+            slots = realloc(slots, max_slots * sizeof(int));
+            while (n < max_slots) slots[n++] = -1;
+        }
+        // connections captured before their open are replayed from their first bytes
+        if (r.type == CAPTURE_OPEN || slots[r.connection] == -1) {
+            slots[r.connection] = num_conns;
+            num_conns += copies;
+            conns = realloc(conns, num_conns * sizeof(replay_conn));
+            for (i = num_conns - copies; i < num_conns; i++) {
+                memset(&conns[i], 0, sizeof(replay_conn));
+                conns[i].fd = -1;
+            }
+        }
+        for (i = 0; i < copies && r.type <= CAPTURE_CLOSE; i++) {
+            add_event(r.type, slots[r.connection] + i, r.time, p, r.length);
+        }
+        if (r.type == CAPTURE_CLOSE) slots[r.connection] = -1;
+        p += r.length;
+    }
+    free(slots);
+    qsort(events, num_events, sizeof(event), compare_events);
+}
+
+static void open_conn(replay_conn *c) {
+
+    c->fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK, server->ai_protocol);
+    if (c->fd == -1) {
+        perror("socket");
+        failed_conns++;
+        return;
+    }
+    if (connect(c->fd, server->ai_addr, server->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        close(c->fd);
+        c->fd = -1;
+        failed_conns++;
+        return;
+    }
+    c->connecting = 1;
+    open_conns++;
+}
+
+static void close_conn(replay_conn *c) {
+
+    close(c->fd);
+    c->fd = -1;
+    open_conns--;
+    free(c->out);
+    c->out = NULL;
+    c->out_len = c->out_sent = 0;
+}
+
+// writes what is due and, once a closed connection has sent all of it, shuts down its end
+static void write_conn(replay_conn *c) {
+
+    if (c->connecting) return;
+
+    while (c->out_sent < c->out_len) {
+        ssize_t sent = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            close_conn(c);
+            failed_conns++;
+            return;
+        }
+        c->out_sent += sent;
+        bytes_sent += sent;
+    }
+    c->out_len = c->out_sent = 0;
+    if (c->closing && !c->shut) {
+        shutdown(c->fd, SHUT_WR);
+        c->shut = 1;
+    }
+}
+
+static void run_event(const event *e) {
+
+    replay_conn *c = &conns[e->connection];
+
+    switch (e->type) {
+        case CAPTURE_OPEN:
+            open_conn(c);
+            break;
+        case CAPTURE_DATA:
+            if (c->fd == -1 && !c->closing) open_conn(c);
+            if (c->fd == -1) break;
+            c->out = realloc(c->out, c->out_len + e->length);
+            memcpy(c->out + c->out_len, e->data, e->length);
+            c->out_len += e->length;
+            write_conn(c);
+            break;
+        case CAPTURE_CLOSE:
+            c->closing = 1;
+            if (c->fd != -1) write_conn(c);
+            break;
+    }
+}
+
+static void read_conn(replay_conn *c) {
+
+    char buffer[65536];
+    ssize_t received;
+
+    while ((received = recv(c->fd, buffer, sizeof(buffer), 0)) > 0) {
+        c->received += received;
+        bytes_received += received;
+    }
+    if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        close_conn(c);
+    }
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr, "Usage:\n\t%s [options] CAPTURE PORTNUMBER\n"
+            "Options:\n"
+            "\t--host HOST    where the server runs (default: localhost)\n"
+            "\t--speed X      replay X times as fast as it was captured\n"
+            "\t--copies N     replay every connection N times over, at once\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+    static const struct option options[] = {
+        {"host", required_argument, NULL, 'h'},
+        {"speed", required_argument, NULL, 's'},
+        {"copies", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    struct addrinfo hints;
+    struct pollfd *pfds;
+    int *polled;
+    const char *host = "localhost";
+    double speed = 1;
+    int copies = 1, opt, rv, i;
+    size_t next = 0;
+    int64_t start, first, last_event = 0;
+
+    while ((opt = getopt_long(argc, argv, "h:s:c:", options, NULL)) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 's': speed = atof(optarg); break;
+            case 'c': copies = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind + 2 != argc || speed <= 0 || copies < 1) usage(argv[0]);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, argv[optind + 1], &hints, &server)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return 1;
+    }
+    load(argv[optind], copies);
+    if (!num_events) {
+        fprintf(stderr, "%s: nothing to replay\n", argv[optind]);
+        return 1;
+    }
+    pfds = malloc(num_conns * sizeof(struct pollfd));
+    polled = malloc(num_conns * sizeof(int));
+
+    first = events[0].time;
+    start = monotonic_ns();
+    while (next < num_events || open_conns) {
+        int64_t now = monotonic_ns(), timeout = -1;
+        int n = 0;
+
+        // everything that is due, and how late it is
+        while (next < num_events && now - start >= (int64_t)((events[next].time - first) / speed)) {
+            int64_t lag = now - start - (int64_t)((events[next].time - first) / speed);
+            if (lag > max_lag) max_lag = lag;
+            if (lag > 1000000) late_events++;
+            run_event(&events[next++]);
+            last_event = now;
+        }
+        if (next == num_events && !open_conns) break;
+        if (next < num_events) {
+            timeout = ((int64_t)((events[next].time - first) / speed) - (now - start)) / 1000000 + 1;
+        } else if (now - last_event > (int64_t)DRAIN_TIMEOUT * 1000000) {
+            break;
+        } else {
+            timeout = DRAIN_TIMEOUT;
+        }
+
+        for (i = 0; i < num_conns; i++) {
+            replay_conn *c = &conns[i];
+            if (c->fd == -1) continue;
+            pfds[n].fd = c->fd;
+            pfds[n].events = POLLIN | (c->connecting || c->out_sent < c->out_len ? POLLOUT : 0);
+            polled[n++] = i;
+        }
+        if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            replay_conn *c = &conns[polled[i]];
+            if (c->fd == -1) continue;
+            if (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP) && c->connecting) {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                c->connecting = 0;
+                if (error) {
+                    fprintf(stderr, "connect: %s\n", strerror(error));
+                    close_conn(c);
+                    failed_conns++;
+                    continue;
+                }
+            }
+            if (pfds[i].revents & POLLOUT || (c->closing && !c->shut)) write_conn(c);
+            if (c->fd != -1 && pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) read_conn(c);
+        }
+    }
+
+    printf("%d connections (%d failed, %d still open), %llu bytes sent, %llu received\n",
+        num_conns, failed_conns, open_conns, (unsigned long long)bytes_sent, (unsigned long long)bytes_received);
+    printf("%.3f s, %.3f s captured; %llu events late by over 1 ms, at most %.3f ms\n",
+        (monotonic_ns() - start) / 1e9, (events[num_events - 1].time - first) / 1e9,
+        (unsigned long long)late_events, max_lag / 1e6);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * File: filecache.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "filecache.h"
+
+/*
+ * On-disk cache of encoded variants of served files. Every worker is
+ * a separate process, so the cache lives in a directory where all of
+ * them can share it and serve hits with sendfile(). Entries are named
+ * after a hash of the path, the file's identity and the encoding. A
+ * changed file therefore never hits a stale entry. An empty entry
+ * records that the file does not compress well enough to bother.
+ */
+
+#define CHUNK (64*1024)
+
+static char *cache_dir;
+
+/*
+ * Uses 'dir' for the cache, creating it if needed. Whatever is in it is
+ * served as the files it stands for, so it has to be the server's own
+ * directory that no one else can write to; otherwise the cache is off.
+ */
+void filecache_init(const char *dir) {
+
+    struct stat st;
+
+    cache_dir = NULL;
+    if (!dir) return;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("filecache");
+        return;
+    }
+    if (lstat(dir, &st) == -1) {
+        perror("filecache");
+        return;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 0777) != 0700) {
+        fprintf(stderr, "filecache: %s must be a directory of our own with mode 0700, not caching\n", dir);
+        return;
+    }
+    cache_dir = strdup(dir);
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+
+    const unsigned char *p = data;
+    while (len--) hash = (hash ^ *p++) * 0x100000001b3ULL;
+    return hash;
+}
+
+/*
+ * Returns the cache file for 'path' in 'encoding', or NULL if the cache
+ * is disabled. The caller frees the result.
+ */
+char *filecache_path(const char *path, const struct stat *st, const char *encoding) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    char *cache_path;
+    int len;
+
+    if (!cache_dir) return NULL;
+
+    hash = fnv1a(hash, path, strlen(path) + 1);
+    hash = fnv1a(hash, &st->st_ino, sizeof(st->st_ino));
+    hash = fnv1a(hash, &st->st_size, sizeof(st->st_size));
+    hash = fnv1a(hash, &st->st_mtim, sizeof(st->st_mtim));
+
+    len = snprintf(NULL, 0, "%s/%016llx.%s", cache_dir, (unsigned long long)hash, encoding);
+    cache_path = malloc(len + 1);
+    snprintf(cache_path, len + 1, "%s/%016llx.%s", cache_dir, (unsigned long long)hash, encoding);
+    return cache_path;
+}
+
+filecache_state filecache_lookup(const char *cache_path, struct stat *cached) {
+
+    if (stat(cache_path, cached) == -1) return FILECACHE_MISS;
+    return cached->st_size ? FILECACHE_HIT : FILECACHE_SKIP;
+}
+
+// gzip 'in' into 'out', returns the compressed size or -1
+static off_t gzip_file(int in, int out) {
+
+    unsigned char input[CHUNK], output[CHUNK];
+    z_stream zs;
+    off_t total = 0;
+    int flush, ret = Z_OK;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+    do {
+        ssize_t n = read(in, input, sizeof(input));
+        if (n < 0) break;
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = input;
+        zs.avail_in = n;
+        do {
+            zs.next_out = output;
+            zs.avail_out = sizeof(output);
+            ret = deflate(&zs, flush);
+            size_t have = sizeof(output) - zs.avail_out;
+            if (have && write(out, output, have) != (ssize_t)have) ret = Z_ERRNO;
+            total += have;
+        } while (zs.avail_out == 0 && ret != Z_ERRNO);
+    } while (flush != Z_FINISH && ret != Z_ERRNO);
+
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END ? total : -1;
+}
+
+/*
+ * Produces the 'encoding' variant of 'path' at 'cache_path'. The entry
+ * is written under a temporary name and renamed into place, so workers
+ * racing on the same file never see a partial entry. Returns
+ * FILECACHE_HIT with 'cached' filled in, FILECACHE_SKIP if the variant
+ * would not save at least a tenth of the size, or FILECACHE_MISS if it
+ * could not be produced.
+ */
+filecache_state filecache_fill(const char *path, const char *cache_path, const char *encoding, struct stat *cached) {
+
+    struct stat st;
+    char *tmp_path;
+    int in, out;
+    off_t size;
+
+    if (strcmp(encoding, "gzip")) return FILECACHE_MISS;
+
+    in = open(path, O_RDONLY);
+    if (in == -1) return FILECACHE_MISS;
+    if (fstat(in, &st) == -1 || st.st_size < FILECACHE_MIN_SIZE || st.st_size > FILECACHE_MAX_SIZE) {
+        close(in);
+        return FILECACHE_MISS;
+    }
+
+    tmp_path = malloc(strlen(cache_path) + 8);
+    sprintf(tmp_path, "%s.XXXXXX", cache_path);
+    out = mkstemp(tmp_path);
+    if (out == -1) {
+        close(in);
+        free(tmp_path);
+        return FILECACHE_MISS;
+    }
+
+    size = gzip_file(in, out);
+    close(in);
+    if (size >= 0 && size > st.st_size - st.st_size / 10 && ftruncate(out, 0) == -1) size = -1;
+    close(out);
+
+    if (size < 0 || rename(tmp_path, cache_path) == -1) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return FILECACHE_MISS;
+    }
+    free(tmp_path);
+
+    return filecache_lookup(cache_path, cached);
+}
@@ -0,0 +1,23 @@
+/*
+ * File: filecache.h
+ */
+
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FILECACHE_MIN_SIZE 256                // smaller files are not worth compressing
+#define FILECACHE_MAX_SIZE (64*1024*1024)     // nor are bigger ones, on the request path
+
+typedef enum {
+    FILECACHE_MISS, FILECACHE_HIT, FILECACHE_SKIP
+} filecache_state;
+
+void filecache_init(const char *dir);
+char *filecache_path(const char *path, const struct stat *st, const char *encoding);
+filecache_state filecache_lookup(const char *cache_path, struct stat *cached);
+filecache_state filecache_fill(const char *path, const char *cache_path, const char *encoding, struct stat *cached);
+
+#endif
@@ -0,0 +1,481 @@
+/*
+ * File: hpack.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "hpack.h"
+
+/*
+ * HPACK header compression (RFC 7541): the static table, a dynamic
+ * table per direction, prefixed integers and Huffman coded strings.
+ */
+
+#define STATIC_ENTRIES 61
+#define ENTRY_OVERHEAD 32
+#define NO_PENDING_SIZE ((size_t)-1)
+
+static const char *static_table[STATIC_ENTRIES][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+    {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+    {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""},
+    {"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+    {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""}
+};
+
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+
+static const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+
+/*
+ * Huffman decoding walks a binary tree built from the code table the
+ * first time it is needed. Inner nodes have positive indices, leaves
+ * are stored as -(symbol + 1).
+ */
+static int16_t huffman_tree[512][2];
+static int huffman_nodes;
+
+static void build_huffman_tree(void) {
+
+    int sym, bit;
+
+    if (huffman_nodes) return;
+    huffman_nodes = 1;
+    for (sym = 0; sym < 256; sym++) {
+        int node = 0;
+        for (bit = huffman_lengths[sym] - 1; bit > 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (!huffman_tree[node][b]) huffman_tree[node][b] = huffman_nodes++;
+            node = huffman_tree[node][b];
+        }
+        huffman_tree[node][huffman_codes[sym] & 1] = -(sym + 1);
+    }
+}
+
+// returns the decoded length, or -1 for invalid codes or padding
+static int huffman_decode(const uint8_t *in, size_t len, char *out) {
+
+    int node = 0, depth = 0, ones = 1;
+    char *o = out;
+    size_t i;
+    int bit;
+
+    build_huffman_tree();
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            ones &= b;
+            depth++;
+            if (next < 0) {
+                *o++ = -next - 1;
+                node = depth = 0;
+                ones = 1;
+            } else if (next == 0) {
+                return -1;    // only EOS lies beyond here
+            } else {
+                node = next;
+            }
+        }
+    }
+    // leftover bits must be a prefix of EOS (all ones), shorter than a byte
+    if (depth > 7 || !ones) return -1;
+    return o - out;
+}
+
+static size_t huffman_length(const char *s, size_t len) {
+
+    size_t bits = 0;
+    while (len--) bits += huffman_lengths[(uint8_t)*s++];
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(hpack_buffer *out, const char *s, size_t len) {
+
+    uint64_t acc = 0;
+    int bits = 0;
+
+    while (len--) {
+        uint8_t sym = *s++;
+        acc = acc << huffman_lengths[sym] | huffman_codes[sym];
+        bits += huffman_lengths[sym];
+        while (bits >= 8) {
+            uint8_t byte = acc >> (bits - 8);
+            hpack_buffer_append(out, &byte, 1);
+            bits -= 8;
+        }
+    }
+    if (bits) {
+        uint8_t byte = (acc << (8 - bits)) | (0xff >> bits);
+        hpack_buffer_append(out, &byte, 1);
+    }
+}
+
+void hpack_buffer_append(hpack_buffer *out, const void *data, size_t len) {
+
+    if (out->len + len > out->cap) {
+        out->cap = out->cap ? out->cap * 2 : 256;
+        if (out->cap < out->len + len) out->cap = out->len + len;
+        out->data = realloc(out->data, out->cap);
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+void hpack_table_init(hpack_table *table, size_t max_size) {
+
+    memset(table, 0, sizeof(*table));
+    table->max_size = max_size;
+    table->pending_size = NO_PENDING_SIZE;
+}
+
+static void evict(hpack_table *table) {
+
+    hpack_entry *e = &table->entries[table->first];
+    table->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+    free(e->name);
+    free(e->value);
+    table->first = (table->first + 1) % table->capacity;
+    table->count--;
+}
+
+void hpack_table_free(hpack_table *table) {
+
+    while (table->count) evict(table);
+    free(table->entries);
+    table->entries = NULL;
+}
+
+void hpack_table_resize(hpack_table *table, size_t max_size) {
+
+    table->max_size = max_size;
+    while (table->count && table->size > max_size) evict(table);
+}
+
+static void insert(hpack_table *table, const char *name, size_t name_len, const char *value, size_t value_len) {
+
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+
+    while (table->count && table->size + size > table->max_size) evict(table);
+    // an entry bigger than the whole table just empties it
+    if (size > table->max_size) return;
+
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 16, i;
+        hpack_entry *entries = malloc(capacity * sizeof(hpack_entry));
+        for (i = 0; i < table->count; i++)
+            entries[i] = table->entries[(table->first + i) % table->capacity];
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+        table->first = 0;
+    }
+
+    hpack_entry *e = &table->entries[(table->first + table->count) % table->capacity];
+    e->name = malloc(name_len + 1);
+    memcpy(e->name, name, name_len);
+    e->name[name_len] = '\0';
+    e->name_len = name_len;
+    e->value = malloc(value_len + 1);
+    memcpy(e->value, value, value_len);
+    e->value[value_len] = '\0';
+    e->value_len = value_len;
+    table->count++;
+    table->size += size;
+}
+
+// looks up a 1-based HPACK index in the static and dynamic tables
+static int lookup(hpack_table *table, uint64_t index, const char **name, size_t *name_len,
+                  const char **value, size_t *value_len) {
+
+    if (index == 0) return -1;
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index - 1][0];
+        *name_len = strlen(*name);
+        *value = static_table[index - 1][1];
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_ENTRIES;
+    if (index > (uint64_t)table->count) return -1;
+    hpack_entry *e = &table->entries[(table->first + table->count - index) % table->capacity];
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+static int decode_integer(const uint8_t **p, const uint8_t *end, int prefix, uint64_t *value) {
+
+    uint64_t max = (1 << prefix) - 1;
+    int shift = 0;
+
+    if (*p >= end) return -1;
+    *value = **p & max;
+    (*p)++;
+    if (*value < max) return 0;
+
+    while (*p < end) {
+        uint8_t byte = *(*p)++;
+        if (shift > 56) return -1;
+        *value += (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+// decodes a string literal into a new NUL-terminated buffer
+static char *decode_string(const uint8_t **p, const uint8_t *end, size_t *len) {
+
+    int huffman;
+    uint64_t length;
+    char *s;
+
+    if (*p >= end) return NULL;
+    huffman = **p & 0x80;
+    if (decode_integer(p, end, 7, &length) || length > (uint64_t)(end - *p)) return NULL;
+
+    if (huffman) {
+        s = malloc(length * 8 / 5 + 1);
+        int n = huffman_decode(*p, length, s);
+        if (n < 0) {
+            free(s);
+            return NULL;
+        }
+        *len = n;
+    } else {
+        s = malloc(length + 1);
+        memcpy(s, *p, length);
+        *len = length;
+    }
+    s[*len] = '\0';
+    *p += length;
+    return s;
+}
+
+/*
+ * Decodes a complete header block, calling 'emit' for every field in
+ * order. Returns 0, -1 on a compression error, or HPACK_TOO_LARGE once
+ * the fields add up to more than 'max_list' bytes, counted as for
+ * SETTINGS_MAX_HEADER_LIST_SIZE. Decoding stops at either error, after
+ * which the connection has to be torn down since the tables are out of
+ * sync.
+ */
+int hpack_decode(hpack_table *table, size_t settings_max, size_t max_list, const uint8_t *block, size_t len,
+    hpack_emit emit, void *ctx) {
+
+    const uint8_t *p = block, *end = block + len;
+    size_t list_size = 0;
+    int fields = 0;
+
+    while (p < end) {
+        uint64_t index;
+        const char *name, *value;
+        size_t name_len, value_len;
+
+        if (*p & 0x80) {
+            // indexed header field
+            if (decode_integer(&p, end, 7, &index) ||
+                lookup(table, index, &name, &name_len, &value, &value_len)) return -1;
+            list_size += name_len + value_len + ENTRY_OVERHEAD;
+            if (list_size > max_list) return HPACK_TOO_LARGE;
+            emit(ctx, name, name_len, value, value_len);
+        } else if ((*p & 0xe0) == 0x20) {
+            // dynamic table size update, only allowed before any field
+            if (fields || decode_integer(&p, end, 5, &index) || index > settings_max) return -1;
+            hpack_table_resize(table, index);
+            continue;
+        } else {
+            int incremental = (*p & 0xc0) == 0x40;
+            char *new_name = NULL, *new_value;
+
+            if (decode_integer(&p, end, incremental ? 6 : 4, &index)) return -1;
+            if (index) {
+                const char *ignored;
+                size_t ignored_len;
+                if (lookup(table, index, &name, &name_len, &ignored, &ignored_len)) return -1;
+            } else {
+                if (!(new_name = decode_string(&p, end, &name_len))) return -1;
+                name = new_name;
+            }
+            if (!(new_value = decode_string(&p, end, &value_len))) {
+                free(new_name);
+                return -1;
+            }
+
+            list_size += name_len + value_len + ENTRY_OVERHEAD;
+            if (list_size > max_list) {
+                free(new_name);
+                free(new_value);
+                return HPACK_TOO_LARGE;
+            }
+            emit(ctx, name, name_len, new_value, value_len);
+            // 'name' may point into the table, so insert a copy first
+            if (incremental) {
+                char *name_copy = malloc(name_len + 1);
+                memcpy(name_copy, name, name_len + 1);
+                insert(table, name_copy, name_len, new_value, value_len);
+                free(name_copy);
+            }
+            free(new_name);
+            free(new_value);
+        }
+        fields++;
+    }
+    return 0;
+}
+
+static void encode_integer(hpack_buffer *out, uint8_t first, int prefix, uint64_t value) {
+
+    uint64_t max = (1 << prefix) - 1;
+    uint8_t byte;
+
+    if (value < max) {
+        byte = first | value;
+        hpack_buffer_append(out, &byte, 1);
+        return;
+    }
+    byte = first | max;
+    hpack_buffer_append(out, &byte, 1);
+    for (value -= max; value >= 0x80; value >>= 7) {
+        byte = (value & 0x7f) | 0x80;
+        hpack_buffer_append(out, &byte, 1);
+    }
+    byte = value;
+    hpack_buffer_append(out, &byte, 1);
+}
+
+// Huffman codes the string whenever that makes it shorter
+static void encode_string(hpack_buffer *out, const char *s, size_t len) {
+
+    size_t huffman_len = huffman_length(s, len);
+
+    if (huffman_len < len) {
+        encode_integer(out, 0x80, 7, huffman_len);
+        huffman_encode(out, s, len);
+    } else {
+        encode_integer(out, 0, 7, len);
+        hpack_buffer_append(out, s, len);
+    }
+}
+
+/*
+ * Appends the field 'name: value' to the header block in 'out'. Fields
+ * already in a table are sent as a single index. Others are sent as
+ * literals, added to the dynamic table when 'indexing' asks for it.
+ * 'name' must be lower case.
+ */
+void hpack_encode(hpack_table *table, hpack_buffer *out, const char *name, const char *value, hpack_indexing indexing) {
+
+    size_t name_len = strlen(name), value_len = strlen(value);
+    uint64_t name_index = 0;
+    int i;
+
+    if (table->pending_size != NO_PENDING_SIZE) {
+        encode_integer(out, 0x20, 5, table->pending_size);
+        table->pending_size = NO_PENDING_SIZE;
+    }
+
+    for (i = 0; i < STATIC_ENTRIES; i++) {
+        if (strcmp(static_table[i][0], name)) continue;
+        if (!name_index) name_index = i + 1;
+        if (!strcmp(static_table[i][1], value)) {
+            encode_integer(out, 0x80, 7, i + 1);
+            return;
+        }
+    }
+    for (i = 1; i <= table->count; i++) {
+        hpack_entry *e = &table->entries[(table->first + table->count - i) % table->capacity];
+        if (e->name_len != name_len || memcmp(e->name, name, name_len)) continue;
+        if (!name_index) name_index = STATIC_ENTRIES + i;
+        if (e->value_len == value_len && !memcmp(e->value, value, value_len)) {
+            encode_integer(out, 0x80, 7, STATIC_ENTRIES + i);
+            return;
+        }
+    }
+
+    if (indexing == HPACK_INDEX)
+        encode_integer(out, 0x40, 6, name_index);
+    else
+        encode_integer(out, indexing == HPACK_NEVER_INDEX ? 0x10 : 0x00, 4, name_index);
+    if (!name_index) encode_string(out, name, name_len);
+    encode_string(out, value, value_len);
+
+    if (indexing == HPACK_INDEX) insert(table, name, name_len, value, value_len);
+}
@@ -0,0 +1,56 @@
+/*
+ * File: hpack.h
+ */
+
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_TOO_LARGE -2             // hpack_decode(): the header list is over its limit
+
+typedef enum {
+    HPACK_INDEX, HPACK_NO_INDEX, HPACK_NEVER_INDEX
+} hpack_indexing;
+
+typedef struct hpack_entry {
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+} hpack_entry;
+
+/*
+ * Dynamic table, kept as a ring of entries from oldest to newest.
+ */
+typedef struct hpack_table {
+    hpack_entry *entries;
+    int capacity;
+    int first;
+    int count;
+    size_t size;
+    size_t max_size;
+    size_t pending_size;    // encoder only: size update owed to the peer, or -1
+} hpack_table;
+
+typedef struct hpack_buffer {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} hpack_buffer;
+
+typedef void (*hpack_emit)(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len);
+
+void hpack_table_init(hpack_table *table, size_t max_size);
+void hpack_table_free(hpack_table *table);
+void hpack_table_resize(hpack_table *table, size_t max_size);
+
+int hpack_decode(hpack_table *table, size_t settings_max, size_t max_list, const uint8_t *block, size_t len,
+    hpack_emit emit, void *ctx);
+void hpack_encode(hpack_table *table, hpack_buffer *out, const char *name, const char *value, hpack_indexing indexing);
+
+void hpack_buffer_append(hpack_buffer *out, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,922 @@
+/*
+ * File: http2.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "http2.h"
+#include "admission.h"
+#include "alloc.h"
+
+/*
+ * Cleartext HTTP/2 (RFC 7540), entered either with the connection
+ * preface ("prior knowledge") or by upgrading an HTTP/1.1 request that
+ * carries "Upgrade: h2c". Every connection is served by its own
+ * process, so a session lives inside the connection it belongs to and
+ * is driven by the same poll loop as HTTP/1.1: service() hands it the
+ * bytes read so far and it queues frames on the connection's output
+ * queue. Streams are multiplexed by interleaving their DATA frames
+ * round robin, within the flow control windows granted by the client.
+ * File bodies are still sent with sendfile(), one frame at a time.
+ */
+
+#define FRAME_HEADER_LEN 9
+#define MAX_WINDOW 0x7fffffff
+
+enum {
+    FRAME_DATA, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+enum {
+    NO_ERROR, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT,
+    STREAM_CLOSED, FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR,
+    CONNECT_ERROR, ENHANCE_YOUR_CALM
+};
+
+// request header fields copied into request_info, by their HTTP/2 name
+static const struct {
+    const char *name;
+    size_t offset;
+} request_fields[] = {
+    {"cache-control", offsetof(request_info, cache_control)},
+    {"user-agent", offsetof(request_info, user_agent)},
+    {"content-length", offsetof(request_info, content_length)},
+    {"content-type", offsetof(request_info, content_type)},
+    {"cookie", offsetof(request_info, cookie)},
+    {"if-modified-since", offsetof(request_info, if_modified_since)},
+    {"if-none-match", offsetof(request_info, if_none_match)},
+    {"range", offsetof(request_info, range)},
+    {"if-range", offsetof(request_info, if_range)},
+    {"accept-encoding", offsetof(request_info, accept_encoding)},
+    {"x-forwarded-for", offsetof(request_info, forwarded_for)},
+    {":authority", offsetof(request_info, host)},
+};
+
+#define NUM_REQUEST_FIELDS (sizeof(request_fields) / sizeof(request_fields[0]))
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void frame_header(uint8_t *header, size_t length, int type, int flags, uint32_t stream_id) {
+    header[0] = length >> 16;
+    header[1] = length >> 8;
+    header[2] = length;
+    header[3] = type;
+    header[4] = flags;
+    put_u32(header + 5, stream_id & MAX_WINDOW);
+}
+
+static void queue_frame(connection *conn, int type, int flags, uint32_t stream_id, const void *payload, size_t length) {
+
+    uint8_t *frame = malloc(FRAME_HEADER_LEN + length);
+    frame_header(frame, length, type, flags, stream_id);
+    if (length) memcpy(frame + FRAME_HEADER_LEN, payload, length);
+    outq_push_buffer(&conn->out, (char *)frame, FRAME_HEADER_LEN + length, 1);
+}
+
+/*
+ * Returns 1 if 'buffer' starts with the HTTP/2 connection preface, 0
+ * if it may still turn out to, and -1 if it is not HTTP/2.
+ */
+int h2_preface(const char *buffer, int used) {
+
+    int len = used < H2_PREFACE_LEN ? used : H2_PREFACE_LEN;
+    if (memcmp(buffer, H2_PREFACE, len)) return -1;
+    return len == H2_PREFACE_LEN;
+}
+
+static void send_goaway(connection *conn, int error) {
+
+    h2_session *session = conn->h2;
+    uint8_t payload[8];
+
+    put_u32(payload, session->last_stream_id);
+    put_u32(payload + 4, error);
+    queue_frame(conn, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    session->goaway_sent = 1;
+    // after an error nothing else the client sends makes sense anymore
+    if (error != NO_ERROR) conn->closing = 1;
+}
+
+static void send_rst_stream(connection *conn, uint32_t stream_id, int error) {
+
+    uint8_t payload[4];
+    put_u32(payload, error);
+    queue_frame(conn, FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_window_update(connection *conn, uint32_t stream_id, uint32_t increment) {
+
+    uint8_t payload[4];
+    put_u32(payload, increment);
+    queue_frame(conn, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static h2_stream *find_stream(h2_session *session, uint32_t id) {
+
+    int i;
+    for (i = 0; i < session->num_streams; i++)
+        if (session->streams[i]->id == id) return session->streams[i];
+    return NULL;
+}
+
+static h2_stream *new_stream(h2_session *session, uint32_t id) {
+
+    h2_stream *stream = calloc(1, sizeof(h2_stream));
+    stream->id = id;
+    stream->send_window = session->initial_window;
+    stream->fd = -1;
+    stream->started = monotonic_ns();
+    session->streams[session->num_streams++] = stream;
+    if (id > session->last_stream_id) session->last_stream_id = id;
+    return stream;
+}
+
+/*
+ * Forgets 'stream'. Frames already queued for it may still reference
+ * its file, so the file is closed by a marker queued behind them.
+ */
+static void free_stream(connection *conn, h2_stream *stream) {
+
+    h2_session *session = conn->h2;
+    unsigned i;
+    int j;
+
+    for (j = 0; j < session->num_streams; j++) {
+        if (session->streams[j] == stream) {
+            session->streams[j] = session->streams[--session->num_streams];
+            break;
+        }
+    }
+    for (i = 0; i < NUM_REQUEST_FIELDS; i++) {
+        char **field = (char **)((char *)&stream->request + request_fields[i].offset);
+        free(*field);
+        *field = NULL;
+    }
+    for (j = 0; j < stream->num_pieces; j++) {
+        h2_piece *piece = &stream->pieces[j];
+        free(piece->data);
+        // closed once what is queued from it has been sent
+        if (piece->fd >= 0 && piece->fd != stream->fd) outq_push_file(&conn->out, piece->fd, 0, 0, 1);
+    }
+    if (stream->fd >= 0) outq_push_file(&conn->out, stream->fd, 0, 0, 1);
+    if (stream->pending) {
+        task_cancel(&conn->tasks, &stream->handler.task);
+        admission_end();
+    }
+    trace_sent(&stream->trace);
+    free(stream->header_block);
+    free(stream->body);
+    free(stream->method);
+    free(stream->path);
+    free(stream);
+}
+
+static char *copy_string(const char *s, size_t len) {
+
+    char *copy = malloc(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static void on_header(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len) {
+
+    h2_stream *stream = ctx;
+    unsigned i;
+
+    if (name_len == 7 && !memcmp(name, ":method", 7)) {
+        if (!stream->method) stream->method = copy_string(value, value_len);
+        return;
+    }
+    if (name_len == 5 && !memcmp(name, ":path", 5)) {
+        if (!stream->path) stream->path = copy_string(value, value_len);
+        return;
+    }
+    if (name_len == 4 && !memcmp(name, "host", 4)) {
+        name = ":authority";
+        name_len = 10;
+    }
+
+    for (i = 0; i < NUM_REQUEST_FIELDS; i++) {
+        if (strlen(request_fields[i].name) != name_len || memcmp(request_fields[i].name, name, name_len))
+            continue;
+
+        char **field = (char **)((char *)&stream->request + request_fields[i].offset);
+        if (!*field) {
+            *field = copy_string(value, value_len);
+        } else if (name_len == 6) {
+            // cookies may be split into several fields (RFC 7540, 8.1.2.5)
+            size_t len = strlen(*field);
+            *field = realloc(*field, len + 2 + value_len + 1);
+            memcpy(*field + len, "; ", 2);
+            memcpy(*field + len + 2, value, value_len);
+            (*field)[len + 2 + value_len] = '\0';
+        }
+        return;
+    }
+}
+
+struct header_block {
+    h2_session *session;
+    hpack_buffer out;
+};
+
+static void encode_response_header(void *ctx, const char *name, const char *value) {
+
+    struct header_block *block = ctx;
+    char lower[64];
+    hpack_indexing indexing = HPACK_INDEX;
+    size_t i;
+
+    for (i = 0; name[i] && i < sizeof(lower) - 1; i++)
+        lower[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 'a' - 'A' : name[i];
+    lower[i] = '\0';
+
+    // connection-specific fields are not allowed in HTTP/2
+    if (!strcmp(lower, "connection") || !strcmp(lower, "transfer-encoding") ||
+        !strcmp(lower, "keep-alive") || !strcmp(lower, "upgrade")) return;
+
+    // values that change with every response would only churn the table
+    if (!strcmp(lower, "date") || !strcmp(lower, "content-length") || !strcmp(lower, "etag") ||
+        !strcmp(lower, "last-modified") || !strcmp(lower, "content-range"))
+        indexing = HPACK_NO_INDEX;
+
+    hpack_encode(&block->session->encoder, &block->out, lower, value, indexing);
+}
+
+// queues a header block as HEADERS plus as many CONTINUATION frames as it takes
+static void queue_headers(connection *conn, uint32_t stream_id, const uint8_t *block, size_t len, int end_stream) {
+
+    h2_session *session = conn->h2;
+    size_t chunk = len < session->peer_max_frame ? len : session->peer_max_frame;
+    int type = FRAME_HEADERS, flags = end_stream ? FLAG_END_STREAM : 0;
+
+    for (;;) {
+        if (chunk == len) flags |= FLAG_END_HEADERS;
+        queue_frame(conn, type, flags, stream_id, block, chunk);
+        block += chunk;
+        len -= chunk;
+        if (!len) break;
+        type = FRAME_CONTINUATION;
+        flags = 0;
+        chunk = len < session->peer_max_frame ? len : session->peer_max_frame;
+    }
+}
+
+static void add_piece(h2_stream *stream, char *data, off_t offset, size_t length) {
+
+    if (!length) {
+        free(data);
+        return;
+    }
+    h2_piece *piece = &stream->pieces[stream->num_pieces++];
+    piece->data = data;
+    piece->offset = offset;
+    piece->length = length;
+    piece->fd = stream->fd;
+    piece->mapped = stream->mapped;
+}
+
+/*
+ * Sends the response its handler produced for 'stream', or the refusal
+ * that took its place. The header block is queued right away and the
+ * body is left to send_data().
+ */
+static void respond(connection *conn, h2_stream *stream) {
+
+    h2_session *session = conn->h2;
+    request_info *request = &stream->request;
+    response_info *response = &stream->handler.response;
+    struct header_block block;
+    int i;
+
+    alloc_attribute(request->command);
+    if ((service_conf.max_requests && conn->requests >= service_conf.max_requests) ||
+        !strncmp(response->connection, "close", strlen("close"))) {
+        if (!session->goaway_sent) send_goaway(conn, NO_ERROR);
+    }
+
+    stream->fd = response->file_fd;
+    stream->mapped = response->data;
+    if ((response->file_fd >= 0 || response->data) && response->num_ranges > 1) {
+        for (i = 0; i < response->num_ranges; i++) {
+            byte_range *range = &response->ranges[i];
+            add_piece(stream, response->part_headers[i], 0, strlen(response->part_headers[i]));
+            add_piece(stream, NULL, range->first, range->last - range->first + 1);
+        }
+        add_piece(stream, response->part_headers[i], 0, strlen(response->part_headers[i]));
+    } else if (response->file_fd >= 0 || response->data) {
+        add_piece(stream, NULL, response->file_offset, response->file_length);
+    } else if (response->num_parts) {
+        for (i = 0; i < response->num_parts; i++) {
+            file_part *part = &response->parts[i];
+            add_piece(stream, part->headers, 0, strlen(part->headers));
+            if (!part->length) {
+                if (part->file_fd >= 0) close(part->file_fd);
+                continue;
+            }
+            add_piece(stream, NULL, 0, part->length);
+            stream->pieces[stream->num_pieces - 1].fd = part->file_fd;
+            stream->pieces[stream->num_pieces - 1].mapped = part->data;
+        }
+        free(response->parts);
+        response->parts = NULL;
+    } else if (response->body) {
+        size_t len = strlen(response->body);
+        add_piece(stream, copy_string(response->body, len), 0, len);
+    }
+
+    block.session = session;
+    memset(&block.out, 0, sizeof(block.out));
+    hpack_encode(&session->encoder, &block.out, ":status", response->status_code, HPACK_INDEX);
+    emit_response_headers(response, encode_response_header, &block);
+    queue_headers(conn, stream->id, block.out.data, block.out.len, !stream->num_pieces);
+    stream->trace.status = atoi(response->status_code);
+    trace_phase(&stream->trace, TRACE_RESPONSE);
+
+    off_t total_len = block.out.len;
+    for (i = 0; i < stream->num_pieces; i++) total_len += stream->pieces[i].length;
+    accesslog_write(LOG_REQUEST, &stream->client, request->command, atoi(response->status_code),
+        total_len, monotonic_ns() - stream->started);
+    free(block.out.data);
+    alloc_attribute(NOTA);
+
+    if (!stream->num_pieces) free_stream(conn, stream);
+}
+
+// runs the handler of 'stream' until it either waits for a helper or is done
+static void resume(connection *conn, h2_stream *stream) {
+
+    if (handler_run(&stream->handler) == TASK_PENDING) return;
+    stream->pending = 0;
+    admission_end();
+    respond(conn, stream);
+}
+
+/*
+ * Answers the request carried by 'stream', which has been received
+ * completely. Other streams go on being served while its handler waits
+ * on a helper.
+ */
+static void dispatch(connection *conn, h2_stream *stream) {
+
+    request_info *request = &stream->request;
+    http_method m;
+
+    stream->dispatched = 1;
+
+    request->req_type = METHOD_UNKNOWN;
+    for (m = 0; stream->method && m < METHOD_UNKNOWN; m++)
+        if (!strcmp(stream->method, http_method_str[m])) request->req_type = m;
+    if (!stream->path) {
+        send_rst_stream(conn, stream->id, PROTOCOL_ERROR);
+        free_stream(conn, stream);
+        return;
+    }
+    request->command = parse_command(stream->path);
+    request->parameters = http_parse_path(stream->path);
+    request->connection = NULL;
+    request->body = stream->body;
+
+    // receiving the stream, header block and body, counts as its recv phase
+    trace_request(&stream->trace, stream->id, stream->started);
+    stream->trace.command = request->command;
+    trace_phase(&stream->trace, TRACE_RECV);
+
+    admission_record_delay(monotonic_ns() - conn->received);
+    find_client(conn->peer, request, &stream->client);
+    admission_verdict verdict = admission_begin(&stream->client, request->command);
+    conn->requests++;
+    trace_phase(&stream->trace, TRACE_ADMISSION);
+    if (verdict == ADMIT) {
+        handler_start(&stream->handler, request, &conn->tasks);
+        stream->handler.trace = &stream->trace;
+        stream->pending = 1;
+        resume(conn, stream);
+    } else {
+        admission_reject(verdict, &stream->handler.response);
+        respond(conn, stream);
+    }
+}
+
+/*
+ * Queues DATA frames for the dispatched streams, one frame per stream
+ * in turn so that a large download does not hold up the others. Stops
+ * when the windows are exhausted or enough is queued for now.
+ */
+static void send_data(connection *conn) {
+
+    h2_session *session = conn->h2;
+    int progress = 1;
+
+    while (progress && session->send_window > 0 && conn->out.queued < OUTQ_HIGH_WATER) {
+        int k;
+        progress = 0;
+        for (k = 0; k < session->num_streams; k++) {
+            int i = (session->next_stream + k) % session->num_streams;
+            h2_stream *stream = session->streams[i];
+            if (!stream->dispatched || stream->pending || stream->send_window <= 0) continue;
+
+            h2_piece *piece = &stream->pieces[stream->next_piece];
+            size_t chunk = piece->length;
+            if (chunk > session->peer_max_frame) chunk = session->peer_max_frame;
+            if ((int64_t)chunk > session->send_window) chunk = session->send_window;
+            if ((int64_t)chunk > stream->send_window) chunk = stream->send_window;
+            int last = chunk == piece->length && stream->next_piece == stream->num_pieces - 1;
+
+            if (piece->data) {
+                queue_frame(conn, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id,
+                    piece->data + piece->offset, chunk);
+            } else {
+                uint8_t *header = malloc(FRAME_HEADER_LEN);
+                frame_header(header, chunk, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id);
+                outq_push_buffer(&conn->out, (char *)header, FRAME_HEADER_LEN, 1);
+                if (piece->mapped) outq_push_buffer(&conn->out, (char *)piece->mapped + piece->offset, chunk, 0);
+                else outq_push_file(&conn->out, piece->fd, piece->offset, chunk, 0);
+            }
+            piece->offset += chunk;
+            piece->length -= chunk;
+            session->send_window -= chunk;
+            stream->send_window -= chunk;
+            if (!piece->length) stream->next_piece++;
+
+            session->next_stream = i + 1;
+            if (last) free_stream(conn, stream);
+            progress = 1;
+            break;
+        }
+    }
+}
+
+/*
+ * Returns 1 if send_data() has DATA frames to queue once the output
+ * queue drains, so the caller keeps polling for POLLOUT.
+ */
+int h2_want_write(connection *conn) {
+
+    h2_session *session = conn->h2;
+    int i;
+
+    if (session->send_window <= 0) return 0;
+    for (i = 0; i < session->num_streams; i++)
+        if (session->streams[i]->dispatched && !session->streams[i]->pending &&
+            session->streams[i]->send_window > 0) return 1;
+    return 0;
+}
+
+static int apply_settings(connection *conn, const uint8_t *payload, size_t length) {
+
+    h2_session *session = conn->h2;
+    size_t pos;
+    int i;
+
+    if (length % 6) return FRAME_SIZE_ERROR;
+    for (pos = 0; pos < length; pos += 6) {
+        int id = payload[pos] << 8 | payload[pos + 1];
+        uint32_t value = get_u32(payload + pos + 2);
+
+        switch (id) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                // never use more than the default, whatever the client allows
+                if (value > HPACK_DEFAULT_TABLE_SIZE) value = HPACK_DEFAULT_TABLE_SIZE;
+                hpack_table_resize(&session->encoder, value);
+                session->encoder.pending_size = value;
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1) return PROTOCOL_ERROR;
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > MAX_WINDOW) return FLOW_CONTROL_ERROR;
+                for (i = 0; i < session->num_streams; i++)
+                    session->streams[i]->send_window += (int64_t)value - session->initial_window;
+                session->initial_window = value;
+                break;
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) return PROTOCOL_ERROR;
+                session->peer_max_frame = value;
+                break;
+        }
+    }
+    return NO_ERROR;
+}
+
+// the block is complete: decode it and answer the request if its body is in too
+static int end_headers(connection *conn, h2_stream *stream) {
+
+    h2_session *session = conn->h2;
+    int result = hpack_decode(&session->decoder, HPACK_DEFAULT_TABLE_SIZE, H2_MAX_HEADER_LIST,
+        (uint8_t *)stream->header_block, stream->header_len, on_header, stream);
+
+    session->continuation_stream = 0;
+    free(stream->header_block);
+    stream->header_block = NULL;
+    stream->header_len = 0;
+    if (result == HPACK_TOO_LARGE) return ENHANCE_YOUR_CALM;
+    if (result) return COMPRESSION_ERROR;
+
+    if (stream->end_stream && !stream->dispatched) dispatch(conn, stream);
+    return NO_ERROR;
+}
+
+static int append_header_block(h2_stream *stream, const uint8_t *fragment, size_t len) {
+
+    if (stream->header_len + len > H2_MAX_HEADER_BLOCK) return ENHANCE_YOUR_CALM;
+    stream->header_block = realloc(stream->header_block, stream->header_len + len);
+    memcpy(stream->header_block + stream->header_len, fragment, len);
+    stream->header_len += len;
+    return NO_ERROR;
+}
+
+static int on_headers(connection *conn, int flags, uint32_t id, const uint8_t *payload, size_t length) {
+
+    h2_session *session = conn->h2;
+    h2_stream *stream = find_stream(session, id);
+    size_t pad = 0;
+
+    if (!id || !(id & 1)) return PROTOCOL_ERROR;
+    if (flags & FLAG_PADDED) {
+        if (length < 1) return FRAME_SIZE_ERROR;
+        pad = payload[0];
+        payload++;
+        length--;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (length < 5) return FRAME_SIZE_ERROR;
+        payload += 5;
+        length -= 5;
+    }
+    if (pad > length) return PROTOCOL_ERROR;
+    length -= pad;
+
+    if (!stream) {
+        // stream ids only go up, reusing one is a connection error (RFC 9113 5.1.1)
+        if (id <= session->last_stream_id) return PROTOCOL_ERROR;
+        if (session->num_streams == H2_MAX_STREAMS || session->goaway_sent || session->goaway_received) {
+            /*
+             * The block still has to go through the decoder to keep the
+             * tables in sync, so only refuse streams that fit one frame.
+             */
+            if (!(flags & FLAG_END_HEADERS)) return ENHANCE_YOUR_CALM;
+            h2_stream refused;
+            memset(&refused, 0, sizeof(refused));
+            refused.dispatched = 1;
+            int result = hpack_decode(&session->decoder, HPACK_DEFAULT_TABLE_SIZE, H2_MAX_HEADER_LIST,
+                payload, length, on_header, &refused);
+            free(refused.method);
+            free(refused.path);
+            unsigned i;
+            for (i = 0; i < NUM_REQUEST_FIELDS; i++)
+                free(*(char **)((char *)&refused.request + request_fields[i].offset));
+            if (result == HPACK_TOO_LARGE) return ENHANCE_YOUR_CALM;
+            if (result) return COMPRESSION_ERROR;
+            if (id > session->last_stream_id && !session->goaway_sent) session->last_stream_id = id;
+            send_rst_stream(conn, id, REFUSED_STREAM);
+            return NO_ERROR;
+        }
+        stream = new_stream(session, id);
+    } else if (stream->end_stream) {
+        return STREAM_CLOSED;
+    }
+
+    if (flags & FLAG_END_STREAM) stream->end_stream = 1;
+    int error = append_header_block(stream, payload, length);
+    if (error) return error;
+    if (flags & FLAG_END_HEADERS) return end_headers(conn, stream);
+    session->continuation_stream = id;
+    return NO_ERROR;
+}
+
+static int on_data(connection *conn, int flags, uint32_t id, const uint8_t *payload, size_t length) {
+
+    h2_session *session = conn->h2;
+    h2_stream *stream = find_stream(session, id);
+    size_t frame_length = length, pad = 0;
+
+    if (!id) return PROTOCOL_ERROR;
+    if (flags & FLAG_PADDED) {
+        if (length < 1) return FRAME_SIZE_ERROR;
+        pad = payload[0];
+        payload++;
+        length--;
+    }
+    if (pad > length) return PROTOCOL_ERROR;
+    length -= pad;
+
+    // the whole frame counts against the window, padding included
+    if (frame_length) send_window_update(conn, 0, frame_length);
+
+    if (!stream || stream->end_stream) {
+        if (id > session->last_stream_id) return PROTOCOL_ERROR;
+        send_rst_stream(conn, id, STREAM_CLOSED);
+        return NO_ERROR;
+    }
+    if (stream->body_len + length > MAX_BODY) {
+        send_rst_stream(conn, id, REFUSED_STREAM);
+        free_stream(conn, stream);
+        return NO_ERROR;
+    }
+
+    stream->body = realloc(stream->body, stream->body_len + length + 1);
+    memcpy(stream->body + stream->body_len, payload, length);
+    stream->body_len += length;
+    stream->body[stream->body_len] = '\0';
+
+    if (flags & FLAG_END_STREAM) {
+        stream->end_stream = 1;
+        if (!stream->header_block) dispatch(conn, stream);
+    } else if (frame_length) {
+        send_window_update(conn, id, frame_length);
+    }
+    return NO_ERROR;
+}
+
+static int on_frame(connection *conn, int type, int flags, uint32_t id, const uint8_t *payload, size_t length) {
+
+    h2_session *session = conn->h2;
+    h2_stream *stream;
+
+    if (session->continuation_stream && (type != FRAME_CONTINUATION || id != session->continuation_stream))
+        return PROTOCOL_ERROR;
+
+    switch (type) {
+        case FRAME_DATA:
+            return on_data(conn, flags, id, payload, length);
+
+        case FRAME_HEADERS:
+            return on_headers(conn, flags, id, payload, length);
+
+        case FRAME_CONTINUATION: {
+            int error;
+            if (!session->continuation_stream) return PROTOCOL_ERROR;
+            stream = find_stream(session, id);
+            if ((error = append_header_block(stream, payload, length))) return error;
+            return flags & FLAG_END_HEADERS ? end_headers(conn, stream) : NO_ERROR;
+        }
+
+        case FRAME_PRIORITY:
+            return length == 5 ? NO_ERROR : FRAME_SIZE_ERROR;
+
+        case FRAME_RST_STREAM:
+            if (!id) return PROTOCOL_ERROR;
+            if (length != 4) return FRAME_SIZE_ERROR;
+            if ((stream = find_stream(session, id))) free_stream(conn, stream);
+            return NO_ERROR;
+
+        case FRAME_SETTINGS: {
+            int error;
+            if (id) return PROTOCOL_ERROR;
+            if (flags & FLAG_ACK) return length ? FRAME_SIZE_ERROR : NO_ERROR;
+            if ((error = apply_settings(conn, payload, length))) return error;
+            queue_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+            return NO_ERROR;
+        }
+
+        case FRAME_PUSH_PROMISE:
+            // clients never push
+            return PROTOCOL_ERROR;
+
+        case FRAME_PING:
+            if (id) return PROTOCOL_ERROR;
+            if (length != 8) return FRAME_SIZE_ERROR;
+            if (!(flags & FLAG_ACK)) queue_frame(conn, FRAME_PING, FLAG_ACK, 0, payload, length);
+            return NO_ERROR;
+
+        case FRAME_GOAWAY:
+            if (id) return PROTOCOL_ERROR;
+            session->goaway_received = 1;
+            return NO_ERROR;
+
+        case FRAME_WINDOW_UPDATE: {
+            uint32_t increment;
+            if (length != 4) return FRAME_SIZE_ERROR;
+            increment = get_u32(payload) & MAX_WINDOW;
+            if (!id) {
+                if (!increment) return PROTOCOL_ERROR;
+                session->send_window += increment;
+                if (session->send_window > MAX_WINDOW) return FLOW_CONTROL_ERROR;
+            } else if ((stream = find_stream(session, id))) {
+                stream->send_window += increment;
+                if (!increment || stream->send_window > MAX_WINDOW) {
+                    send_rst_stream(conn, id, increment ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+                    free_stream(conn, stream);
+                }
+            }
+            return NO_ERROR;
+        }
+
+        default:
+            // unknown frame types must be ignored
+            return NO_ERROR;
+    }
+}
+
+static int base64url_value(char c) {
+
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '-' || c == '+') return 62;
+    if (c == '_' || c == '/') return 63;
+    return -1;
+}
+
+// decodes the HTTP2-Settings header of an upgrade request, returns its length or -1
+static int base64url_decode(const char *in, uint8_t *out, int max) {
+
+    int bits = 0, len = 0, value;
+    uint32_t acc = 0;
+
+    for (; *in && *in != '=' && !isspace((unsigned char)*in); in++) {
+        if ((value = base64url_value(*in)) < 0) return -1;
+        acc = acc << 6 | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (len == max) return -1;
+            out[len++] = acc >> bits;
+        }
+    }
+    return len;
+}
+
+/*
+ * Turns 'conn' into an HTTP/2 connection and sends the server's
+ * SETTINGS. 'settings' is the HTTP2-Settings header of an upgrade
+ * request, which stands in for the client's first SETTINGS frame, or
+ * NULL when the client starts with the connection preface.
+ */
+void h2_start(connection *conn, const char *settings) {
+
+    h2_session *session = calloc(1, sizeof(h2_session));
+    uint8_t payload[12];
+    int nodelay = 1;
+
+    session->expect_preface = 1;
+    hpack_table_init(&session->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    hpack_table_init(&session->encoder, HPACK_DEFAULT_TABLE_SIZE);
+    session->send_window = H2_DEFAULT_WINDOW;
+    session->initial_window = H2_DEFAULT_WINDOW;
+    session->peer_max_frame = H2_MAX_FRAME_SIZE;
+    conn->h2 = session;
+
+    /*
+     * A frame that uses up the rest of a window is often small, and the
+     * client will not open the window again before it has seen it.
+     */
+    setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(payload + 2, H2_MAX_STREAMS);
+    payload[6] = 0;
+    payload[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put_u32(payload + 8, H2_MAX_HEADER_LIST);
+    queue_frame(conn, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+
+    if (settings) {
+        uint8_t decoded[256];
+        int len = base64url_decode(settings, decoded, sizeof(decoded));
+        if (len < 0 || apply_settings(conn, decoded, len)) send_goaway(conn, PROTOCOL_ERROR);
+    }
+}
+
+/*
+ * Switches an HTTP/1.1 connection to HTTP/2 after 'request' asked for
+ * it. The request itself becomes stream 1, and is answered over HTTP/2
+ * once the switch has been acknowledged.
+ */
+void h2_upgrade(connection *conn, request_info *request) {
+
+    static const char switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    h2_stream *stream;
+    unsigned i;
+
+    outq_push_buffer(&conn->out, (char *)switching, sizeof(switching) - 1, 0);
+    h2_start(conn, request->http2_settings);
+    if (conn->closing) return;
+
+    stream = new_stream(conn->h2, 1);
+    stream->end_stream = 1;
+    stream->started = conn->started;
+    if (request->req_type < METHOD_UNKNOWN) stream->method = strdup(http_method_str[request->req_type]);
+    for (i = 0; i < NUM_REQUEST_FIELDS; i++) {
+        char **from = (char **)((char *)request + request_fields[i].offset);
+        char **to = (char **)((char *)&stream->request + request_fields[i].offset);
+        if (*from) *to = strdup(*from);
+    }
+
+    // 'parameters' is the path of the request, query string included
+    stream->path = strdup(request->parameters ? request->parameters : "/");
+    dispatch(conn, stream);
+}
+
+/*
+ * Processes the frames in the connection buffer and queues whatever
+ * they call for. Returns 0, since everything received so far has been
+ * dealt with, unless the output queue filled up first.
+ */
+int h2_service(connection *conn) {
+
+    h2_session *session = conn->h2;
+    int pos = 0, i;
+
+    if (session->expect_preface) {
+        int preface = h2_preface(conn->buffer, conn->used);
+        if (preface < 0) {
+            send_goaway(conn, PROTOCOL_ERROR);
+            return 0;
+        }
+        if (!preface) return 0;
+        pos = H2_PREFACE_LEN;
+        session->expect_preface = 0;
+    }
+
+    while (!conn->closing && conn->out.queued < OUTQ_HIGH_WATER && conn->used - pos >= FRAME_HEADER_LEN) {
+        const uint8_t *frame = (uint8_t *)conn->buffer + pos;
+        size_t length = frame[0] << 16 | frame[1] << 8 | frame[2];
+        int error;
+
+        if (length > H2_MAX_FRAME_SIZE) {
+            send_goaway(conn, FRAME_SIZE_ERROR);
+            break;
+        }
+        if ((size_t)(conn->used - pos) < FRAME_HEADER_LEN + length) break;
+
+        error = on_frame(conn, frame[3], frame[4], get_u32(frame + 5) & MAX_WINDOW,
+            frame + FRAME_HEADER_LEN, length);
+        pos += FRAME_HEADER_LEN + length;
+        if (error) {
+            send_goaway(conn, error);
+            break;
+        }
+    }
+
+    if (pos) {
+        conn->used -= pos;
+        memmove(conn->buffer, conn->buffer + pos, conn->used);
+    }
+
+    // streams whose helper reported back; one that finishes may take the place of the last
+    for (i = session->num_streams - 1; i >= 0; i--) {
+        h2_stream *stream = session->streams[i];
+        if (stream->pending && !stream->handler.task.waiting) resume(conn, stream);
+    }
+
+    send_data(conn);
+    if ((session->goaway_sent || session->goaway_received) && !session->num_streams) conn->closing = 1;
+    return 0;
+}
+
+/*
+ * Lets the streams already open run to completion but refuses new
+ * ones, closing the connection once they are done.
+ */
+void h2_shutdown(connection *conn) {
+
+    h2_session *session = conn->h2;
+
+    if (!session->goaway_sent) send_goaway(conn, NO_ERROR);
+    if (!session->num_streams) conn->closing = 1;
+}
+
+void h2_free(connection *conn) {
+
+    h2_session *session = conn->h2;
+
+    if (!session) return;
+    while (session->num_streams) free_stream(conn, session->streams[0]);
+    hpack_table_free(&session->decoder);
+    hpack_table_free(&session->encoder);
+    free(session);
+    conn->h2 = NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ * File: http2.h
+ */
+
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hpack.h"
+#include "service.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_MAX_STREAMS 100
+#define H2_MAX_FRAME_SIZE 16384         // the default, we never advertise more
+#define H2_MAX_HEADER_BLOCK (64*1024)
+#define H2_MAX_HEADER_LIST (64*1024)    // decoded, as SETTINGS_MAX_HEADER_LIST_SIZE counts it
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_PIECES (2*MAX_PARTS+2)   // header and body for each of MAX_PARTS or MAX_RANGES, plus trailer
+
+typedef struct h2_piece {
+    char *data;         // buffer piece, NULL for a range of the body
+    off_t offset;
+    size_t length;
+    int fd;             // where the range is, the stream's unless it is one of several files
+    const char *mapped;
+} h2_piece;
+
+typedef struct h2_stream {
+    uint32_t id;
+    int64_t send_window;
+    int end_stream;             // the client has finished its request
+    int dispatched;
+    int pending;                // its handler waits on a helper
+    char *header_block;
+    size_t header_len;
+    char *body;
+    size_t body_len;
+    char *method;
+    char *path;
+    request_info request;       // header values are owned by the stream
+    request_handler handler;
+    trace_span trace;
+    h2_piece pieces[H2_MAX_PIECES];
+    int num_pieces;
+    int next_piece;
+    int fd;                     // file backing the response body, or -1
+    const char *mapped;         // memory backing it instead, see response_info.data
+    int64_t started;
+    log_peer client;            // whom the request is for, see find_client()
+} h2_stream;
+
+typedef struct h2_session {
+    int expect_preface;
+    hpack_table decoder;
+    hpack_table encoder;
+    h2_stream *streams[H2_MAX_STREAMS];
+    int num_streams;
+    uint32_t last_stream_id;
+    uint32_t continuation_stream;   // stream whose header block is still open
+    int64_t send_window;
+    int64_t initial_window;
+    uint32_t peer_max_frame;
+    int goaway_sent;
+    int goaway_received;
+    int next_stream;                // round robin position for DATA frames
+} h2_session;
+
+int h2_preface(const char *buffer, int used);
+void h2_start(connection *conn, const char *settings);
+void h2_upgrade(connection *conn, request_info *request);
+int h2_service(connection *conn);
+int h2_want_write(connection *conn);
+void h2_shutdown(connection *conn);
+void h2_free(connection *conn);
+
+#endif
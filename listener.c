@@ -0,0 +1,387 @@
+/*
+ * File: listener.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "listener.h"
+
+listener_config listener_conf = {
+    1024,   // backlog
+    1,      // defer_accept
+    1,      // nodelay
+    256,    // fastopen
+    0,      // reuseport
+    0660    // unix_mode
+};
+
+// options that only make the listener faster are allowed to fail
+static void set_option(int lst_socket, int level, int name, int value, const char *what) {
+
+    if (value && setsockopt(lst_socket, level, name, &value, sizeof(value)) == -1) {
+        fprintf(stderr, "server: %s: %s\n", what, strerror(errno));
+    }
+}
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "server: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// whether the socket at 'addr' was left behind by a server that is gone
+static int stale_socket(const struct sockaddr_un *addr) {
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int stale = probe != -1 && connect(probe, (const struct sockaddr *)addr, sizeof(*addr)) == -1 &&
+        errno == ECONNREFUSED;
+
+    if (probe != -1) close(probe);
+    return stale;
+}
+
+/*
+ * Listens on a Unix socket at 'path', for a reverse proxy on the same
+ * host. A socket left there by a server that died is replaced, one
+ * that a server still answers on is not. Exits the process if the
+ * socket cannot be set up.
+ */
+static int open_unix(const char *path) {
+
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int lst_socket, rv;
+
+    if (unix_address(path, &addr) == -1) exit(2);
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "server: %s is not a socket\n", path);
+            exit(2);
+        }
+        if (!stale_socket(&addr)) {
+            fprintf(stderr, "server: %s is in use\n", path);
+            exit(2);
+        }
+        unlink(path);
+    }
+    if ((lst_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("server: socket");
+        exit(1);
+    }
+
+    // created with its final permissions, never more open than those
+    mask = umask(~listener_conf.unix_mode & 0777);
+    rv = bind(lst_socket, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rv == -1) {
+        perror("server: bind");
+        exit(2);
+    }
+
+    if (listen(lst_socket, listener_conf.backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    return lst_socket;
+}
+
+/*
+ * Binds a non-blocking listening socket to 'port' and applies the
+ * options in listener_conf. Accepted sockets inherit TCP_NODELAY.
+ * A 'port' of LISTENER_UNIX followed by a path listens on a Unix
+ * socket instead. Exits the process if no address can be bound.
+ */
+int listener_open(const char *port) {
+
+    int lst_socket;
+    struct addrinfo hints, *servinfo, *p;
+    int yes = 1;
+    int rv;
+
+    if (!strncmp(port, LISTENER_UNIX, strlen(LISTENER_UNIX))) {
+        return open_unix(port + strlen(LISTENER_UNIX));
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; // use my IP
+
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+
+    // loop through all the results and bind to the first we can
+    for(p = servinfo; p != NULL; p = p->ai_next) {
+        if ((lst_socket = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                p->ai_protocol)) == -1) {
+            perror("server: socket");
+            continue;
+        }
+
+        if (setsockopt(lst_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            exit(1);
+        }
+
+        if (listener_conf.reuseport &&
+            setsockopt(lst_socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            exit(1);
+        }
+
+        if (bind(lst_socket, p->ai_addr, p->ai_addrlen) == -1) {
+            close(lst_socket);
+            perror("server: bind");
+            continue;
+        }
+
+        break;
+    }
+
+    if (p == NULL)  {
+        fprintf(stderr, "server: failed to bind\n");
+        exit(2);
+    }
+
+    freeaddrinfo(servinfo); // all done with this structure
+
+    // don't wake up for connections that have not sent anything yet
+    set_option(lst_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, listener_conf.defer_accept, "TCP_DEFER_ACCEPT");
+    // responses are written in as few calls as possible, see outq_flush()
+    set_option(lst_socket, IPPROTO_TCP, TCP_NODELAY, listener_conf.nodelay, "TCP_NODELAY");
+    // lets returning clients send their request along with the SYN
+    set_option(lst_socket, IPPROTO_TCP, TCP_FASTOPEN, listener_conf.fastopen, "TCP_FASTOPEN");
+
+    if (listen(lst_socket, listener_conf.backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    return lst_socket;
+}
+
+/*
+ * Takes up to 'max' pending connections off the accept queue without
+ * blocking. The sockets come back non-blocking and close-on-exec, and
+ * their peers are only copied, to be formatted by the log drainer.
+ * Returns how many were accepted.
+ */
+int listener_accept(int lst_socket, accepted *batch, int max) {
+
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size;
+    int n = 0;
+
+    while (n < max) {
+        sin_size = sizeof(their_addr);
+        int clt_socket = accept4(lst_socket, (struct sockaddr *)&their_addr, &sin_size,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clt_socket == -1) {
+            int error = errno;
+            if (error == EINTR || error == ECONNABORTED) continue;
+            if (error != EAGAIN && error != EWOULDBLOCK) perror("accept");
+            // out of descriptors: the queue stays readable, so don't spin on it
+            if (error == EMFILE || error == ENFILE) usleep(10000);
+            break;
+        }
+        batch[n].socket = clt_socket;
+        accesslog_peer(&batch[n].peer, (struct sockaddr *)&their_addr);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Sets 'peer' to the client a proxy forwarded a request for, the last
+ * address in its X-Forwarded-For: the one the proxy added itself, the
+ * others are whatever the client claimed. Only a proxy on the Unix
+ * socket is trusted with it. Returns -1 if there is no address.
+ */
+int listener_forwarded_peer(log_peer *peer, const char *forwarded_for) {
+
+    const char *last = strrchr(forwarded_for, ',');
+    char addr[INET6_ADDRSTRLEN];
+    size_t len;
+
+    last = last ? last + 1 : forwarded_for;
+    while (*last == ' ' || *last == '\t') last++;
+    for (len = 0; last[len] && last[len] != ' ' && last[len] != '\t' && last[len] != '\r'; len++);
+    if (len >= sizeof(addr)) return -1;
+    memcpy(addr, last, len);
+    addr[len] = '\0';
+
+    memset(peer, 0, sizeof(*peer));
+    if (inet_pton(AF_INET, addr, peer->addr) == 1) {
+        peer->family = AF_INET;
+    } else if (inet_pton(AF_INET6, addr, peer->addr) == 1) {
+        peer->family = AF_INET6;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hot restart: a running server listens on a Unix socket at 'path'. A
+ * new server started with the same path connects to it and receives
+ * the listening sockets with SCM_RIGHTS, so the accept queue and the
+ * port are never released. Once the new server acknowledges them the
+ * old one stops accepting and drains its connections. Only a process
+ * of the same user may take part, on either end.
+ */
+
+// true if the process at the other end of 'fd' runs as the same user as we do
+static int same_user(int fd) {
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+}
+
+/*
+ * Listens for a successor at 'path', replacing whatever was there.
+ * Returns the non-blocking socket, or -1.
+ */
+int listener_handoff_open(const char *path) {
+
+    struct sockaddr_un addr;
+    mode_t mask;
+    int handoff_socket, rv;
+
+    if (unix_address(path, &addr) == -1) return -1;
+    if ((handoff_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("server: handoff socket");
+        return -1;
+    }
+    unlink(path);
+    // whoever can connect is handed the listening sockets
+    mask = umask(0177);
+    rv = bind(handoff_socket, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rv == -1 || listen(handoff_socket, 1) == -1) {
+        perror("server: handoff bind");
+        close(handoff_socket);
+        return -1;
+    }
+    return handoff_socket;
+}
+
+/*
+ * Passes 'sockets' to the successor that connected to 'handoff_socket'
+ * and waits for it to acknowledge them. Returns 0 once it has, after
+ * which the caller must stop accepting, and -1 if the handoff failed.
+ */
+int listener_handoff_send(int handoff_socket, const int *sockets, int count) {
+
+    char control[CMSG_SPACE(LISTENER_MAX_HANDOFF * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct pollfd pfd;
+    unsigned char n = count, ack;
+    int successor, result = -1;
+
+    successor = accept4(handoff_socket, NULL, NULL, SOCK_CLOEXEC);
+    if (successor == -1) return -1;
+    if (!same_user(successor)) {
+        fprintf(stderr, "server: refused a handoff to another user\n");
+        close(successor);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &n;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), sockets, count * sizeof(int));
+
+    // a successor that never answers must not stall the accept loop for long
+    pfd.fd = successor;
+    pfd.events = POLLIN;
+    if (sendmsg(successor, &msg, MSG_NOSIGNAL) == 1 && poll(&pfd, 1, 5000) == 1 &&
+        read(successor, &ack, 1) == 1) {
+        result = 0;
+    }
+    close(successor);
+    return result;
+}
+
+/*
+ * Takes over the listening sockets of the server running at 'path'.
+ * Returns how many were received, or -1 if no server handed any over.
+ */
+int listener_handoff_receive(const char *path, int *sockets, int max) {
+
+    char control[CMSG_SPACE(LISTENER_MAX_HANDOFF * sizeof(int))];
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    unsigned char n, ack = 1;
+    int predecessor, count = -1;
+
+    if (unix_address(path, &addr) == -1) return -1;
+    if ((predecessor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) return -1;
+    // nobody listening, e.g. a stale socket left by a crash: start afresh
+    if (connect(predecessor, (struct sockaddr *)&addr, sizeof(addr)) == -1 || !same_user(predecessor)) {
+        close(predecessor);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &n;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(predecessor, &msg, MSG_CMSG_CLOEXEC) == 1 &&
+        (cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), i;
+        int *fds = (int *)CMSG_DATA(cmsg);
+        for (i = 0; i < received; i++) {
+            if (i < max) sockets[i] = fds[i];
+            else close(fds[i]);
+        }
+        count = received < max ? received : max;
+        if (write(predecessor, &ack, 1) != 1) {
+            for (i = 0; i < count; i++) close(sockets[i]);
+            count = -1;
+        }
+    }
+    close(predecessor);
+    return count;
+}
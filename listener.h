@@ -0,0 +1,42 @@
+/*
+ * File: listener.h
+ */
+
+#ifndef _LISTENER_H_
+#define _LISTENER_H_
+
+#include "accesslog.h"
+
+#define LISTENER_BATCH 64     // connections taken off the accept queue per wakeup
+#define LISTENER_UNIX "unix:" // prefix of a Unix socket path given in place of a port
+
+/*
+ * Listening socket options. A value of 0 disables the corresponding
+ * option, except for the backlog which the kernel caps at somaxconn.
+ */
+typedef struct listener_config {
+    int backlog;
+    int defer_accept;       // seconds to wait for the first request bytes
+    int nodelay;
+    int fastopen;           // TCP Fast Open queue length
+    int reuseport;          // several listeners share the port, one per acceptor
+    int unix_mode;          // permissions of a Unix listening socket
+} listener_config;
+
+extern listener_config listener_conf;
+
+typedef struct accepted {
+    int socket;
+    log_peer peer;
+} accepted;
+
+#define LISTENER_MAX_HANDOFF 64   // listening sockets passed on a hot restart
+
+int listener_open(const char *port);
+int listener_accept(int lst_socket, accepted *batch, int max);
+int listener_forwarded_peer(log_peer *peer, const char *forwarded_for);
+int listener_handoff_open(const char *path);
+int listener_handoff_send(int handoff_socket, const int *sockets, int count);
+int listener_handoff_receive(const char *path, int *sockets, int max);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * File: memo.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "memo.h"
+
+/*
+ * Responses kept for reuse, in a shared mapping so that what one worker
+ * produced serves the connections of all the others. An entry is picked
+ * by the hash of its key alone and a newer response simply takes its
+ * place. Entries are guarded by a sequence number rather than a lock: a
+ * writer makes it odd while it copies, and a reader that sees it change
+ * under it drops what it read. Writers never wait for one another, the
+ * one that loses the race does not store anything.
+ */
+
+typedef struct memo_entry {
+    atomic_uint version;        // odd while it is being written
+    uint32_t key_len;
+    uint32_t value_len;
+    uint64_t hash;
+    char data[MEMO_SLOT];       // the key, then the value
+} memo_entry;
+
+memo_config memo_conf = {
+    1024    // entries
+};
+
+static memo_entry *entries;
+static size_t mask;
+
+static uint64_t hash_key(const char *key, size_t len) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// must be called before the first fork() so that every worker shares the entries
+void memo_init(void) {
+
+    size_t n = 1;
+
+    if (memo_conf.entries <= 0) return;
+    while (n < (size_t)memo_conf.entries) n *= 2;
+
+    entries = mmap(NULL, n * sizeof(memo_entry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (entries == MAP_FAILED) {
+        perror("memo");
+        entries = NULL;
+        return;
+    }
+    mask = n - 1;
+}
+
+/*
+ * Returns a copy of the value stored under 'key' and sets 'len' to its
+ * length, or returns NULL if there is none. The copy is the caller's.
+ */
+char *memo_get(const char *key, size_t key_len, size_t *len) {
+
+    uint64_t hash = hash_key(key, key_len);
+    memo_entry *e;
+    unsigned version;
+    char *value;
+
+    if (!entries) return NULL;
+    e = &entries[hash & mask];
+    version = atomic_load_explicit(&e->version, memory_order_acquire);
+    if (version & 1 || e->hash != hash || e->key_len != key_len ||
+        key_len + e->value_len > MEMO_SLOT || memcmp(e->data, key, key_len)) {
+        return NULL;
+    }
+    *len = e->value_len;
+    value = malloc(*len);
+    memcpy(value, e->data + key_len, *len);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&e->version, memory_order_relaxed) != version) {
+        free(value);
+        return NULL;
+    }
+    return value;
+}
+
+// stores 'value' under 'key', unless it does not fit or another worker is storing there
+void memo_put(const char *key, size_t key_len, const char *value, size_t len) {
+
+    uint64_t hash = hash_key(key, key_len);
+    memo_entry *e;
+    unsigned version;
+
+    if (!entries || key_len + len > MEMO_SLOT) return;
+    e = &entries[hash & mask];
+    version = atomic_load(&e->version);
+    if (version & 1 || !atomic_compare_exchange_strong(&e->version, &version, version + 1)) return;
+
+    e->hash = hash;
+    e->key_len = key_len;
+    e->value_len = len;
+    memcpy(e->data, key, key_len);
+    memcpy(e->data + key_len, value, len);
+    atomic_store_explicit(&e->version, version + 2, memory_order_release);
+}
@@ -0,0 +1,22 @@
+/*
+ * File: memo.h
+ */
+
+#ifndef _MEMO_H_
+#define _MEMO_H_
+
+#include <stddef.h>
+
+#define MEMO_SLOT 4096          // room for the key and value of an entry
+
+typedef struct memo_config {
+    int entries;            // responses kept, shared by every worker (0: off)
+} memo_config;
+
+extern memo_config memo_conf;
+
+void memo_init(void);
+char *memo_get(const char *key, size_t key_len, size_t *len);
+void memo_put(const char *key, size_t key_len, const char *value, size_t len);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * File: orders.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "orders.h"
+
+/*
+ * The checkout store: an append-only file of fixed-size records and an
+ * index from each user to their latest record, from which the others
+ * are found by following the back links. The index lives in a shared
+ * mapping, so that the orders any worker appends are found by all the
+ * others, and is rebuilt from the file when the server starts. Reads
+ * go through a read-only mapping of the file, so listing the orders of
+ * a user touches those records and nothing else.
+ *
+ * A record's place in the file and in its user's chain is reserved
+ * under the user's lock, and written after it is released. The locks
+ * are robust: one whose owner died is taken over with the slot as it
+ * was left, which is consistent after any single store. A record
+ * that is not there yet, or was never written whole, fails its check
+ * and ends the list of orders it is in.
+ */
+
+typedef struct user_slot {
+    pthread_mutex_t lock;
+    int used;
+    char user[ORDERS_NAME_LEN];
+    uint64_t latest;        // number of the user's latest record plus one
+} user_slot;
+
+typedef struct orders_state {
+    _Atomic uint64_t next_record;
+    user_slot users[ORDERS_USERS];
+} orders_state;
+
+static orders_state *state;
+static int store = -1;
+static const order_record *records;     // this process's mapping of the file
+static uint64_t num_mapped;
+
+static void lock(user_slot *slot) {
+    if (pthread_mutex_lock(&slot->lock) == EOWNERDEAD) pthread_mutex_consistent(&slot->lock);
+}
+
+static void unlock(user_slot *slot) {
+    pthread_mutex_unlock(&slot->lock);
+}
+
+static void copy_name(char *to, const char *from) {
+    strncpy(to, from, ORDERS_NAME_LEN - 1);
+    to[ORDERS_NAME_LEN - 1] = '\0';
+}
+
+/*
+ * Returns the slot of 'user' locked, claiming a free one if 'create'
+ * is set, or NULL if the user has none or the index is full.
+ */
+static user_slot *find_user(const char *user, int create) {
+
+    char key[ORDERS_NAME_LEN];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const char *p;
+    int i;
+
+    copy_name(key, user);
+    for (p = key; *p; p++) hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+
+    for (i = 0; i < ORDERS_USERS; i++) {
+        user_slot *slot = &state->users[(hash + i) & (ORDERS_USERS - 1)];
+        lock(slot);
+        if (slot->used && !strcmp(slot->user, key)) return slot;
+        if (!slot->used) {
+            if (!create) {
+                unlock(slot);
+                return NULL;
+            }
+            // claimed last, so that a slot is never in use without its name
+            strcpy(slot->user, key);
+            slot->latest = 0;
+            slot->used = 1;
+            return slot;
+        }
+        unlock(slot);
+    }
+    return NULL;
+}
+
+static uint64_t record_check(const order_record *record) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p = (const unsigned char *)record;
+    size_t i;
+
+    for (i = 0; i < offsetof(order_record, check); i++) hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+static int record_valid(const order_record *record) {
+
+    return record->check == record_check(record);
+}
+
+// makes sure records below 'count' are mapped, as far as the file holds them
+static int map_records(uint64_t count) {
+
+    struct stat st;
+
+    if (fstat(store, &st) == -1) return -1;
+    // past the end of the file the mapping would raise SIGBUS
+    if (count > st.st_size / sizeof(order_record)) count = st.st_size / sizeof(order_record);
+    if (count <= num_mapped) return 0;
+    if (records) munmap((void *)records, num_mapped * sizeof(order_record));
+    records = mmap(NULL, count * sizeof(order_record), PROT_READ, MAP_SHARED, store, 0);
+    if (records == MAP_FAILED) {
+        records = NULL;
+        num_mapped = 0;
+        return -1;
+    }
+    num_mapped = count;
+    return 0;
+}
+
+/*
+ * Opens the store at 'path', creating it if needed, and indexes the
+ * records already in it. Must be called before the first fork() so that
+ * every worker shares the index. Returns -1 if the store is unusable.
+ */
+int orders_init(const char *path) {
+
+    pthread_mutexattr_t attr;
+    struct stat st;
+    uint64_t i, count;
+
+    if ((store = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1 || fstat(store, &st) == -1) {
+        perror("orders");
+        return -1;
+    }
+    state = mmap(NULL, sizeof(orders_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("orders");
+        state = NULL;
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < ORDERS_USERS; i++) pthread_mutex_init(&state->users[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // a record cut short by a crash is written over by the next order
+    count = st.st_size / sizeof(order_record);
+    if (count && map_records(count) == -1) {
+        perror("orders");
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (!record_valid(&records[i])) continue;
+        user_slot *slot = find_user(records[i].user, 1);
+        if (slot) {
+            slot->latest = i + 1;
+            unlock(slot);
+        }
+    }
+    atomic_store(&state->next_record, count);
+    return 0;
+}
+
+/*
+ * Stores an order of 'num_items' items for 'user'. Returns 0, or -1 if
+ * it could not be written.
+ */
+int orders_append(const char *user, char **items, int num_items) {
+
+    order_record record;
+    user_slot *slot;
+    uint64_t number;
+    int i, result;
+
+    if (!state) return -1;
+    memset(&record, 0, sizeof(record));
+    record.time = time(NULL);
+    copy_name(record.user, user);
+    for (i = 0; i < num_items && i < ORDERS_MAX_ITEMS; i++) copy_name(record.items[i], items[i]);
+    record.num_items = i;
+
+    // the user's slot is locked only while the record takes its place in their chain
+    slot = find_user(user, 1);
+    number = atomic_fetch_add(&state->next_record, 1);
+    if (slot) {
+        record.prev = slot->latest;
+        slot->latest = number + 1;
+        unlock(slot);
+    }
+    record.check = record_check(&record);
+    result = pwrite(store, &record, sizeof(record), number * sizeof(record)) == sizeof(record) ? 0 : -1;
+
+    // unless another order has been chained to it meanwhile, the failed one is taken out
+    if (result == -1 && slot) {
+        lock(slot);
+        if (slot->latest == number + 1) slot->latest = record.prev;
+        unlock(slot);
+    }
+    return result;
+}
+
+/*
+ * Lists the orders of 'user', latest first, as text. Returns NULL if
+ * there are none. The caller frees the result.
+ */
+char *orders_list(const char *user) {
+
+    user_slot *slot;
+    uint64_t number;
+    char *list = NULL;
+    size_t len = 0, size = 0;
+
+    if (!state || !(slot = find_user(user, 0))) return NULL;
+    number = slot->latest;
+    unlock(slot);
+    if (!number || map_records(atomic_load(&state->next_record)) == -1) return NULL;
+
+    while (number && number <= num_mapped) {
+        const order_record *record = &records[number - 1];
+        char date[32];
+        time_t when = record->time;
+        unsigned i;
+
+        if (!record_valid(record)) break;
+        if (size - len < 64 + ORDERS_MAX_ITEMS * (ORDERS_NAME_LEN + 8)) {
+            size = size ? size * 2 : 4096;
+            list = realloc(list, size);
+        }
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", gmtime(&when));
+        len += sprintf(list + len, "Order %llu, %s GMT\n", (unsigned long long)number, date);
+        for (i = 0; i < record->num_items && i < ORDERS_MAX_ITEMS; i++) {
+            len += sprintf(list + len, "%u. %.*s\n", i + 1, ORDERS_NAME_LEN, record->items[i]);
+        }
+        number = record->prev;
+    }
+    return list;
+}
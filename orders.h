@@ -0,0 +1,32 @@
+/*
+ * File: orders.h
+ */
+
+#ifndef _ORDERS_H_
+#define _ORDERS_H_
+
+#include <stdint.h>
+
+#define ORDERS_MAX_ITEMS 12     // as many as the cart holds
+#define ORDERS_NAME_LEN 64      // longer user and item names are cut short
+#define ORDERS_USERS 65536      // users the index can hold, must be a power of two
+
+/*
+ * One checkout as stored on disk. Records are never changed once
+ * written, and each links back to the previous order of the same user.
+ */
+typedef struct order_record {
+    uint32_t num_items;
+    uint32_t reserved;
+    int64_t time;
+    uint64_t prev;          // number of the user's previous record plus one, 0 for none
+    char user[ORDERS_NAME_LEN];
+    char items[ORDERS_MAX_ITEMS][ORDERS_NAME_LEN];
+    uint64_t check;         // of all of the above, fails on a record not written completely
+} order_record;
+
+int orders_init(const char *path);
+int orders_append(const char *user, char **items, int num_items);
+char *orders_list(const char *user);
+
+#endif
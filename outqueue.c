@@ -0,0 +1,151 @@
+/*
+ * File: outqueue.c
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "outqueue.h"
+#include "alloc.h"
+
+void outq_init(outqueue *q) {
+
+    q->head = q->tail = NULL;
+    q->queued = 0;
+}
+
+static void release(out_segment *seg) {
+
+    if (seg->owned) {
+        if (seg->data) free(seg->data);
+        else close(seg->fd);
+    }
+    free(seg);
+}
+
+/*
+ * Empty segments are dropped, unless they own something: those stay
+ * queued so the buffer or file is released only once everything
+ * queued before them has been sent.
+ */
+static void push(outqueue *q, out_segment *seg) {
+
+    if (!seg->length && !seg->owned) {
+        release(seg);
+        return;
+    }
+    seg->next = NULL;
+    if (q->tail) q->tail->next = seg;
+    else q->head = seg;
+    q->tail = seg;
+    q->queued += seg->length;
+}
+
+/*
+ * Queues 'length' bytes of 'data'. If 'owned' is set, the queue frees
+ * the buffer once it has been sent.
+ */
+void outq_push_buffer(outqueue *q, char *data, size_t length, int owned) {
+
+    out_segment *seg = malloc(sizeof(out_segment));
+    seg->data = data;
+    seg->fd = -1;
+    seg->offset = 0;
+    seg->length = length;
+    seg->owned = owned;
+    push(q, seg);
+}
+
+/*
+ * Queues 'length' bytes of the file 'fd' starting at 'offset', to be
+ * sent with sendfile(). If 'owned' is set, the queue closes the file
+ * once it has been sent.
+ */
+void outq_push_file(outqueue *q, int fd, off_t offset, size_t length, int owned) {
+
+    out_segment *seg = malloc(sizeof(out_segment));
+    seg->data = NULL;
+    seg->fd = fd;
+    seg->offset = offset;
+    seg->length = length;
+    seg->owned = owned;
+    push(q, seg);
+}
+
+// drops 'sent' bytes from the front of the queue, for writers other than outq_flush()
+void outq_consume(outqueue *q, size_t sent) {
+
+    q->queued -= sent;
+    while (q->head && sent >= q->head->length) {
+        out_segment *seg = q->head;
+        sent -= seg->length;
+        q->head = seg->next;
+        release(seg);
+    }
+    if (!q->head) q->tail = NULL;
+    else {
+        q->head->offset += sent;
+        q->head->length -= sent;
+    }
+}
+
+/*
+ * Writes as much of the queue as the socket accepts without blocking.
+ * Consecutive buffer segments go out in a single sendmsg() and file
+ * segments with sendfile(). Returns 1 once the queue is empty, 0 if the
+ * socket would block, and -1 on error.
+ */
+int outq_flush(outqueue *q, int socket) {
+
+    while (q->head) {
+        ssize_t sent;
+
+        if (!q->head->length) {
+            outq_consume(q, 0);
+            continue;
+        }
+        if (q->head->data) {
+            struct iovec iov[OUTQ_MAX_IOV];
+            struct msghdr msg;
+            out_segment *seg;
+            int n = 0;
+
+            for (seg = q->head; seg && seg->data && n < OUTQ_MAX_IOV; seg = seg->next, n++) {
+                iov[n].iov_base = seg->data + seg->offset;
+                iov[n].iov_len = seg->length;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            // a header followed by file data should not go out as a packet of its own
+            sent = sendmsg(socket, &msg, MSG_NOSIGNAL | (seg && !seg->data ? MSG_MORE : 0));
+        } else {
+            off_t offset = q->head->offset;
+            sent = sendfile(socket, q->head->fd, &offset, q->head->length);
+            // the file shrank underneath us, nothing sensible left to send
+            if (sent == 0) return -1;
+        }
+
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        outq_consume(q, sent);
+    }
+    return 1;
+}
+
+void outq_clear(outqueue *q) {
+
+    while (q->head) {
+        out_segment *seg = q->head;
+        q->head = seg->next;
+        release(seg);
+    }
+    outq_init(q);
+}
@@ -0,0 +1,35 @@
+/*
+ * File: outqueue.h
+ */
+
+#ifndef _OUTQUEUE_H_
+#define _OUTQUEUE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUTQ_HIGH_WATER (256*1024)   // stop reading requests above this many queued bytes
+#define OUTQ_MAX_IOV 64
+
+typedef struct out_segment {
+    struct out_segment *next;
+    char *data;         // buffer segment, NULL for a file segment
+    int fd;             // file segment, -1 for a buffer segment
+    off_t offset;
+    size_t length;      // bytes still to be sent
+    int owned;          // free the buffer / close the file once sent
+} out_segment;
+
+typedef struct outqueue {
+    out_segment *head, *tail;
+    size_t queued;
+} outqueue;
+
+void outq_init(outqueue *q);
+void outq_push_buffer(outqueue *q, char *data, size_t length, int owned);
+void outq_push_file(outqueue *q, int fd, off_t offset, size_t length, int owned);
+int outq_flush(outqueue *q, int socket);
+void outq_consume(outqueue *q, size_t sent);
+void outq_clear(outqueue *q);
+
+#endif
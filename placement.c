@@ -0,0 +1,99 @@
+/*
+ * File: placement.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/mempolicy.h>
+
+#include "placement.h"
+
+/*
+ * Worker placement. Each listed CPU gets an acceptor process pinned to
+ * it, and the workers it forks inherit that pinning. Memory is taken
+ * from the node local to the CPU, so a connection's buffers, the file
+ * cache pages it touches and its malloc arenas all stay on one node.
+ */
+
+placement_config placement_conf;
+
+static int add_cpu(int cpu) {
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE || placement_conf.num_cpus == PLACEMENT_MAX_CPUS) return -1;
+    placement_conf.cpus[placement_conf.num_cpus++] = cpu;
+    return 0;
+}
+
+/*
+ * Parses a CPU list such as "0-3,8,10-11", or "all" for every CPU the
+ * server may run on. Returns 0, or -1 if the list is malformed.
+ */
+int placement_parse(const char *list) {
+
+    const char *p = list;
+    char *end;
+
+    placement_conf.num_cpus = 0;
+    if (!strcmp(list, "all")) {
+        cpu_set_t allowed;
+        int cpu;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return -1;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed) && add_cpu(cpu) == -1) break;
+        return 0;
+    }
+
+    while (*p) {
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) return -1;
+        p = end;
+        if (*p == '-') {
+            last = strtol(++p, &end, 10);
+            if (end == p || last < first) return -1;
+            p = end;
+        }
+        for (; first <= last; first++)
+            if (add_cpu(first) == -1) return -1;
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return placement_conf.num_cpus ? 0 : -1;
+}
+
+/*
+ * Pins the calling process, and whatever it forks from now on, to
+ * 'cpu' and has its memory allocated on that CPU's node.
+ */
+void placement_pin(int cpu) {
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        fprintf(stderr, "server: cannot pin to cpu %d: %s\n", cpu, strerror(errno));
+        return;
+    }
+    // pages are placed when first touched, which now happens on 'cpu'
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1 && errno != ENOSYS) {
+        fprintf(stderr, "server: set_mempolicy: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Among SO_REUSEPORT listeners, has the kernel prefer 'lst_socket' for
+ * connections whose packets are processed on 'cpu'.
+ */
+void placement_steer(int lst_socket, int cpu) {
+
+    if (setsockopt(lst_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+        fprintf(stderr, "server: SO_INCOMING_CPU: %s\n", strerror(errno));
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ * File: placement.h
+ */
+
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+#define PLACEMENT_MAX_CPUS 64    // acceptors, one per listed CPU
+
+/*
+ * Where acceptors and their workers run. With no CPUs listed the
+ * server runs a single acceptor wherever the scheduler puts it.
+ */
+typedef struct placement_config {
+    int cpus[PLACEMENT_MAX_CPUS];
+    int num_cpus;
+    int incoming_cpu;       // steer each listener's connections to its CPU
+} placement_config;
+
+extern placement_config placement_conf;
+
+int placement_parse(const char *list);
+void placement_pin(int cpu);
+void placement_steer(int lst_socket, int cpu);
+
+#endif
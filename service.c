@@ -2,7 +2,7 @@
  * File: service.c
  */
 
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,87 +18,623 @@
 #include <signal.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <poll.h>
+#include <limits.h>
+#include <fcntl.h>
 
 #include "service.h"
+#include "accesslog.h"
+#include "listener.h"
+#include "filecache.h"
+#include "http2.h"
+#include "admission.h"
+#include "bufpool.h"
+#include "trace.h"
+#include "orders.h"
+#include "bundle.h"
+#include "tls.h"
+#include "capture.h"
+#include "memo.h"
+#include "broadcast.h"
+#include "alloc.h"
+
+const char *command_str[] = {"/login" , "/logout" , "/servertime", "/browser", "/redirect",
+	"/getfile","/putfile","/addcart","/delcart","/checkout", "/close", "/orders", "/getfiles"};
+
+service_config service_conf = {
+	30000,	//idle_timeout
+	100,	//max_requests
+	300000	//max_lifetime
+};
+
+volatile sig_atomic_t service_draining = 0;
+
+void service_drain(int sig) {
+	service_draining = 1;
+}
+
+static uint64_t monotonic_ms() {
+	return monotonic_ns()/1000000;
+}
+
+static void touch_connection(connection* conn) {
+	if (service_conf.idle_timeout) {
+		timer_schedule(&conn->timers, &conn->idle_timer, conn->timers.now + service_conf.idle_timeout);
+	}
+}
+
+//a connection waiting on its own helper is not idle
+static void connection_idle(timer_entry* timer, void* arg) {
+	connection* conn = (connection*)arg;
+	if (conn->tasks.num_jobs) {
+		touch_connection(conn);
+	} else {
+		conn->expired = 1;
+	}
+}
+
+//past its lifetime a connection takes no new requests, but finishes what it has
+static void connection_retired(timer_entry* timer, void* arg) {
+	((connection*)arg)->retired = 1;
+}
+
+/*
+ * The request buffer is a slab borrowed from the shared pool only while
+ * there is input to parse, so idle connections hold none. A request too
+ * large for a slab moves into a heap buffer, since the parsers need it
+ * in one piece; that buffer is freed as well once the connection is idle.
+ */
+static void grow_buffer(connection* conn) {
+	if (!conn->buffer) {
+		conn->buffer = bufpool_get();
+		conn->size = bufpool_conf.slab_size;
+	} else if (bufpool_owns(conn->buffer)) {
+		char* overflow = (char*)malloc(conn->size*2);
+		memcpy(overflow, conn->buffer, conn->used);
+		bufpool_put(conn->buffer);
+		conn->buffer = overflow;
+		conn->size *= 2;
+	} else {
+		conn->size *= 2;
+		conn->buffer = (char*)realloc(conn->buffer, conn->size);
+	}
+}
+
+static void release_buffer(connection* conn) {
+	if (conn->buffer) {
+		bufpool_put(conn->buffer);
+		conn->buffer = NULL;
+		conn->size = 0;
+	}
+}
 
-int service(int socket, char* request_string, char* response_string, int* length) {
-	int len = *length;
-	int curr_len = 0;
+// the socket and the output queue, through TLS on an HTTPS connection
+static int receive(connection* conn, char* buffer, int length) {
+	if (conn->tls) {
+		return tls_recv(conn->tls, buffer, length);
+	}
+	return recv(conn->socket, buffer, length, 0);
+}
 
-	request_info request;
-	response_info response;
+static int flush_output(connection* conn) {
+	if (conn->tls) {
+		return tls_flush(conn->tls, &conn->out, conn->socket);
+	}
+	return outq_flush(&conn->out, conn->socket);
+}
+
+/*
+ * Reads whatever the client has sent so far, either into the request
+ * buffer or, once a request header has been parsed, into its body.
+ * Returns 1 if the connection is still usable, 0 if the client closed
+ * its end and -1 on errors.
+ */
+static int read_input(connection* conn) {
+	int bytes_received;
+	char* input;
 
-	while(http_header_complete(request_string, curr_len) == -1) {
-		int bytes_received = recv(socket, request_string+curr_len, len-curr_len,0);
-		if (bytes_received == 0) {
-			return 1; //should not assume request end means close connection
+	if (conn->header_len) {
+		input = conn->body+conn->body_used;
+		bytes_received = receive(conn, input, conn->body_len-conn->body_used);
+	} else {
+		if (conn->used >= conn->size-1) {
+			grow_buffer(conn);
 		}
-		curr_len += bytes_received;
+		input = conn->buffer+conn->used;
+		bytes_received = receive(conn, input, conn->size-conn->used-1);
+	}
+
+	if (bytes_received < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 1 : -1;
+	}
+	if (bytes_received == 0) {
+		return 0;
+	}
+	capture_data(conn->capture, input, bytes_received);
+
+	conn->received = monotonic_ns();
+	if (!conn->started) {
+		conn->started = conn->received;
+	}
+	if (conn->header_len) {
+		conn->body_used += bytes_received;
+	} else {
+		conn->used += bytes_received;
+	}
+	touch_connection(conn);
+	return 1;
+}
+
+// queues part of the body, from memory or else from the file, which 'last' closes
+static void queue_body(connection* conn, response_info* response, off_t offset, off_t length, int last) {
+	if (response->data) {
+		outq_push_buffer(&conn->out, (char*)response->data+offset, length, 0);
+	} else {
+		outq_push_file(&conn->out, response->file_fd, offset, length, last);
+	}
+}
 
-		if (curr_len >= len/2) {
-			len *= 2;
-			request_string = (char*)realloc(request_string, len);
+/*
+ * Queues the serialized response, and the file or memory backing its
+ * body if there is one. Returns the number of bytes queued.
+ */
+static int queue_response(connection* conn, response_info* response) {
+	char* response_string = response->headers ? print_response_start(response) : print_response(response);
+	int total_len = strlen(response_string);
+
+	outq_push_buffer(&conn->out, response_string, total_len, 1);
+	if (response->headers) {
+		outq_push_buffer(&conn->out, (char*)response->headers, response->headers_len, response->headers_owned);
+		total_len += response->headers_len;
+	}
+	if ((response->file_fd >= 0 || response->data) && response->num_ranges > 1) {
+		//multipart/byteranges: every part shares the file, the last one closes it
+		int i;
+		for (i = 0; i < response->num_ranges; i++) {
+			byte_range* range = &response->ranges[i];
+			outq_push_buffer(&conn->out, response->part_headers[i], strlen(response->part_headers[i]), 1);
+			queue_body(conn, response, range->first, range->last-range->first+1, i == response->num_ranges-1);
+		}
+		outq_push_buffer(&conn->out, response->part_headers[i], strlen(response->part_headers[i]), 1);
+		total_len += atoll(response->content_length);
+	} else if (response->file_fd >= 0 || response->data) {
+		queue_body(conn, response, response->file_offset, response->file_length, 1);
+		total_len += response->file_length;
+	} else if (response->num_parts) {
+		int i;
+		for (i = 0; i < response->num_parts; i++) {
+			file_part* part = &response->parts[i];
+			outq_push_buffer(&conn->out, part->headers, strlen(part->headers), 1);
+			if (part->data) {
+				outq_push_buffer(&conn->out, (char*)part->data, part->length, 0);
+			} else if (part->file_fd >= 0) {
+				outq_push_file(&conn->out, part->file_fd, 0, part->length, 1);
+			}
 		}
+		free(response->parts);
+		response->parts = NULL;
+		total_len += atoll(response->content_length);
+	}
+	return total_len;
+}
+
+#define MEMO_USER_AGENT 1
+#define MEMO_USERNAME 2
+
+/*
+ * The commands whose responses are kept for reuse, see memo.h, and the
+ * inputs their responses depend on. Like Vary, only these make up the
+ * key: the rest of the request is ignored.
+ */
+static const struct {
+	int inputs;
+	const char* param;	//query parameter, if any
+} memoized[NOTA] = {
+	[BROWSER] = {MEMO_USER_AGENT | MEMO_USERNAME, NULL},
+	[REDIRECT] = {MEMO_USER_AGENT, "url"},
+};
+
+//appends 'value' to a key of 'len' bytes, telling a missing value apart from an empty one
+static size_t add_key_part(char* key, size_t len, const char* value) {
+	size_t value_len = value ? strlen(value) : 0;
+
+	if (!len || len+value_len+2 > MEMO_SLOT) {
+		return 0;
 	}
-	parse_request(request_string, &request, len);
+	key[len++] = value != NULL;
+	memcpy(key+len, value, value_len);
+	len += value_len;
+	key[len++] = '\0';
+	return len;
+}
 
-	if (request.content_length) {
-		const char* body_so_far = http_parse_body(request_string, len);
+/*
+ * Writes the key the response to the request of 'h' is kept under to
+ * 'key', which has room for MEMO_SLOT bytes. Returns its length, or 0
+ * if the response is not kept.
+ */
+static size_t memo_key(request_handler* h, char* key) {
+	command_type command = h->request->command;
+	size_t len = 0;
 
-		int body_len = atoi(request.content_length);
-		curr_len = strlen(body_so_far);
-		if (curr_len < body_len) {
-			char* body = (char*)malloc(body_len);
-			strcpy(body, body_so_far);
+	if (!h->run || command >= NOTA || !memoized[command].inputs) {
+		return 0;
+	}
+	key[len++] = command+1;
+	if (memoized[command].inputs & MEMO_USER_AGENT) {
+		len = add_key_part(key, len, h->request->user_agent);
+	}
+	if (memoized[command].inputs & MEMO_USERNAME) {
+		char* user_id = extract_cookie(h->request->cookie, "username");
+		len = add_key_part(key, len, user_id);
+		free(user_id);
+	}
+	if (memoized[command].param) {
+		len = add_key_part(key, len, params_get(&h->query, memoized[command].param));
+	}
+	return len;
+}
 
-			while (curr_len < body_len) {
-				int bytes_received = recv(socket, body+curr_len, body_len-curr_len,0);
+/*
+ * Answers with the response kept for the same inputs, if there is one,
+ * in place of running the handler. Only the status line, Date and
+ * Connection are written anew.
+ */
+static void serve_memoized(request_handler* h) {
+	response_info* response = &h->response;
+	char key[MEMO_SLOT];
+	size_t key_len = memo_key(h, key), len;
+	char* value = key_len ? memo_get(key, key_len, &len) : NULL;
 
-				if (bytes_received <= 0) {
-					return 1;
-				}
+	if (!value) {
+		return;
+	}
+	//the header fields and body, then the status code and message
+	response->headers = value;
+	response->headers_len = strlen(value);
+	response->headers_owned = 1;
+	response->status_code = value+response->headers_len+1;
+	response->status_msg = response->status_code+strlen(response->status_code)+1;
+	h->run = NULL;
+}
+
+// keeps the response 'h' produced, unless it came from what was kept
+static void memoize(request_handler* h) {
+	response_info* response = &h->response;
+	char key[MEMO_SLOT];
+	size_t key_len;
+
+	if (response->headers || !(key_len = memo_key(h, key))) {
+		return;
+	}
+	char* fields = print_response_fields(response);
+	size_t fields_len = strlen(fields);
+	size_t code_len = strlen(response->status_code)+1;
+	size_t msg_len = strlen(response->status_msg)+1;
+	char* value = (char*)malloc(fields_len+1+code_len+msg_len);
+
+	memcpy(value, fields, fields_len+1);
+	memcpy(value+fields_len+1, response->status_code, code_len);
+	memcpy(value+fields_len+1+code_len, response->status_msg, msg_len);
+	memo_put(key, key_len, value, fields_len+1+code_len+msg_len);
+	free(value);
+	free(fields);
+}
+
+static const char bad_request[] =
+	"HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char too_large[] =
+	"HTTP/1.1 413 Content Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+/*
+ * Refuses the request whose header has just been parsed, before its
+ * body is read, with 'response', and closes the connection.
+ */
+static int refuse_request(connection* conn, const char* response, int status) {
+	size_t len = strlen(response);
+
+	outq_push_buffer(&conn->out, (char*)response, len, 0);
+	conn->closing = 1;
+	conn->used = 0;
+	conn->header_len = 0;
+	conn->trace.status = status;
+	trace_phase(&conn->trace, TRACE_RESPONSE);
+	accesslog_write(LOG_REQUEST, &conn->client, conn->request.command, status, len,
+		monotonic_ns() - conn->started);
+	alloc_attribute(NOTA);
+	return 1;
+}
+
+/*
+ * Handles the next request in the connection buffer, if it has been
+ * received completely. Returns 1 if a response was queued and 0 if
+ * more input is needed first.
+ */
+int service(connection* conn) {
+	request_info* request = &conn->request;
 
-				curr_len += bytes_received;
+	if (conn->h2) {
+		return h2_service(conn);
+	}
+	if (!conn->header_len && !conn->used) {
+		return 0;
+	}
+	//a client with prior knowledge of HTTP/2 opens with the connection preface
+	if (!conn->requests && !conn->header_len) {
+		int preface = h2_preface(conn->buffer, conn->used);
+		if (preface == 0) {
+			return 0;
+		}
+		if (preface == 1) {
+			h2_start(conn, NULL);
+			return h2_service(conn);
+		}
+	}
+
+	if (!conn->header_len) {
+		int header_len = http_header_complete(conn->buffer, conn->used);
+		if (header_len == -1) {
+			return 0;
+		}
+
+		trace_request(&conn->trace, conn->requests+1, conn->started);
+		trace_phase(&conn->trace, TRACE_RECV);
+		parse_request(conn->buffer, request, header_len);
+		alloc_attribute(request->command);
+		find_client(conn->peer, request, &conn->client);
+		conn->trace.command = request->command;
+		trace_phase(&conn->trace, TRACE_PARSE);
+		long long body_len = 0;
+		if (request->content_length) {
+			char* end;
+			errno = 0;
+			body_len = strtoll(request->content_length, &end, 10);
+			if (errno || end == request->content_length || *end || body_len < 0) {
+				return refuse_request(conn, bad_request, 400);
 			}
-			request.body = body;	
-		} else {
-			request.body = body_so_far;
 		}
+		if (body_len > MAX_BODY) {
+			return refuse_request(conn, too_large, 413);
+		}
+		conn->header_len = header_len;
+		conn->body = NULL;
+		conn->body_len = body_len;
+		conn->body_used = 0;
+
+		if (conn->body_len > 0) {
+			conn->body_used = conn->used - header_len;
+			if (conn->body_used > conn->body_len) {
+				conn->body_used = conn->body_len;
+			}
+			conn->body = (char*)malloc(conn->body_len+1);
+			if (!conn->body) {
+				return refuse_request(conn, too_large, 413);
+			}
+			memcpy(conn->body, conn->buffer+header_len, conn->body_used);
+		}
+		conn->consumed = header_len + conn->body_used;
 	}
-	build_response(&request, &response);
 
-	response_string = print_response(&response);
+	if (conn->body_used < conn->body_len) {
+		return 0;
+	}
+	if (conn->body) {
+		conn->body[conn->body_len] = '\0';
+		request->body = conn->body;
+	}
 
-	int total_len = strlen(response_string);
-	curr_len = 0;
-	while (curr_len < total_len) {
-		curr_len += send(socket,response_string+curr_len, total_len - curr_len, 0);	
+	//requests with a body are answered over HTTP/1.1 without upgrading
+	if (request->upgrade && request->http2_settings && !conn->body &&
+		!strcasecmp(request->upgrade, "h2c")) {
+		h2_upgrade(conn, request);
+		conn->used -= conn->consumed;
+		memmove(conn->buffer, conn->buffer+conn->consumed, conn->used);
+		conn->header_len = 0;
+		return 1;
 	}
 
-	*length = len;
+	admission_verdict verdict = ADMIT;
+	if (!TASK_RUNNING(&conn->handler.task)) {
+		if (conn->body) {
+			trace_phase(&conn->trace, TRACE_BODY);
+		}
+		admission_record_delay(monotonic_ns() - conn->received);
+		verdict = admission_begin(&conn->client, request->command);
+		conn->requests++;
+		trace_phase(&conn->trace, TRACE_ADMISSION);
+		if (verdict == ADMIT) {
+			handler_start(&conn->handler, request, &conn->tasks);
+			conn->handler.trace = &conn->trace;
+			serve_memoized(&conn->handler);
+		}
+	}
 
-	return strncmp(response.connection, "close", strlen("close"));
+	if (verdict == ADMIT) {
+		//a handler waiting on a helper is resumed once the helper reports back
+		if (handler_run(&conn->handler) == TASK_PENDING) {
+			return 0;
+		}
+		response_info* response = &conn->handler.response;
+		memoize(&conn->handler);
+
+		//the stream goes on from the broadcaster, which needs the socket to itself
+		if (response->event_stream && !conn->tls && broadcast_ready()) {
+			response->content_length = NULL;
+			response->connection = "close";
+			conn->streaming = 1;
+		}
+
+		if (service_conf.max_requests && conn->requests >= service_conf.max_requests) {
+			response->connection = "close";
+		}
+		if (!strncmp(response->connection, "close", strlen("close"))) {
+			conn->closing = 1;
+		}
+
+		int total_len = queue_response(conn, response);
+		admission_end();
+		conn->trace.status = atoi(response->status_code);
+		trace_phase(&conn->trace, TRACE_RESPONSE);
+
+		accesslog_write(LOG_REQUEST, &conn->client, request->command, atoi(response->status_code),
+			total_len, monotonic_ns() - conn->started);
+	} else {
+		size_t len;
+		const char* rejection = admission_response(verdict, &len);
+		outq_push_buffer(&conn->out, (char*)rejection, len, 0);
+		if (verdict == ADMIT_SHED) {
+			conn->closing = 1;
+		}
+		conn->trace.status = verdict == ADMIT_SHED ? 503 : 429;
+		trace_phase(&conn->trace, TRACE_RESPONSE);
+		accesslog_write(LOG_REQUEST, &conn->client, request->command, verdict == ADMIT_SHED ? 503 : 429,
+			len, monotonic_ns() - conn->started);
+	}
+
+	free(conn->body);
+	conn->body = NULL;
+
+	//drop the request from the buffer, keeping what was pipelined after it
+	conn->used -= conn->consumed;
+	memmove(conn->buffer, conn->buffer+conn->consumed, conn->used);
+	conn->header_len = 0;
+	conn->started = conn->used ? monotonic_ns() : 0;
+	alloc_attribute(NOTA);
+
+	return 1;
 }
 
-void handle_client(int socket) {
-    
-	int len = 10000;
-	char* request_string = (char*)malloc(len);
-	char* response_string = NULL;
+/*
+ * Serves the connection on 'socket', which has to be non-blocking, until
+ * either side closes it or it times out.
+ */
+void handle_client(int socket, const log_peer* peer) {
+
+	connection conn;
+	tls_session tls;
+	memset(&conn, 0, sizeof(conn));
+	conn.socket = socket;
+	conn.peer = peer;
+	alloc_attribute(NOTA);
+
+	if (tls_conf.cert) {
+		if (tls_accept(&tls, socket) == -1) {
+			return;
+		}
+		conn.tls = &tls;
+	}
+	conn.capture = capture_open();
+	outq_init(&conn.out);
+	task_loop_init(&conn.tasks);
+	timer_wheel_init(&conn.timers, monotonic_ms());
+	timer_init(&conn.idle_timer, connection_idle, &conn);
+	timer_init(&conn.lifetime_timer, connection_retired, &conn);
+	touch_connection(&conn);
+	if (service_conf.max_lifetime) {
+		timer_schedule(&conn.timers, &conn.lifetime_timer, conn.timers.now + service_conf.max_lifetime);
+	}
 
 	//persistent connection open
-	printf("connection opened\n");
+	accesslog_write(LOG_OPEN, peer, NOTA, 0, 0, 0);
+
+	while (!conn.expired) {
+		struct pollfd pfd[2] = {{socket, 0, 0}, {conn.tasks.wake[0], 0, 0}};
+		//when draining, close as soon as no request is half received
+		if ((service_draining || conn.retired) && !conn.closing) {
+			if (conn.h2) {
+				h2_shutdown(&conn);
+			} else if (conn.retired || (!conn.header_len && !conn.used)) {
+				conn.closing = 1;
+			}
+		}
+		//stop reading new requests while the client is slow to take its responses,
+		//and while a request is in progress its buffer must stay where it is
+		if (!conn.closing && conn.out.queued < OUTQ_HIGH_WATER && !TASK_RUNNING(&conn.handler.task)) {
+			pfd[0].events |= POLLIN;
+		}
+		if (conn.out.head || (conn.h2 && h2_want_write(&conn))) {
+			pfd[0].events |= POLLOUT;
+		}
+		if (conn.tasks.num_jobs) {
+			pfd[1].events |= POLLIN;
+		}
+		if (!pfd[0].events && !pfd[1].events) {
+			break;
+		}
+
+		//request bytes TLS has already decrypted would not wake poll() up
+		int buffered = conn.tls && (pfd[0].events & POLLIN) && tls_pending(conn.tls);
+		int64_t timeout = buffered ? 0 : timer_wheel_timeout(&conn.timers);
+		int ready = poll(pfd, 2, timeout > INT_MAX ? INT_MAX : (int)timeout);
+		timer_wheel_advance(&conn.timers, monotonic_ms());
+		if (ready < 0 && errno != EINTR) {
+			break;
+		}
+		if (ready <= 0 && !buffered) {
+			continue;
+		}
 
-	int open = 1;
-	while (open) {
-		open = service(socket, request_string, response_string, &len);
+		if (pfd[0].revents & (POLLERR | POLLNVAL)) {
+			break;
+		}
+		if (pfd[0].revents & POLLOUT) {
+			size_t queued = conn.out.queued;
+			if (flush_output(&conn) < 0) {
+				break;
+			}
+			if (conn.out.queued < queued) {
+				touch_connection(&conn);
+			}
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			task_loop_collect(&conn.tasks);
+		}
+
+		int input = 1;
+		if ((pfd[0].events & POLLIN) && ((pfd[0].revents & (POLLIN | POLLHUP)) || buffered)) {
+			input = read_input(&conn);
+			if (input < 0) {
+				break;
+			}
+		}
+
+		//a request already being handled is answered even if the connection is closing
+		while ((!conn.closing || TASK_RUNNING(&conn.handler.task)) && conn.out.queued < OUTQ_HIGH_WATER &&
+			service(&conn));
+		if (input == 0) {
+			//the client is done sending, answer what it sent and close
+			conn.closing = 1;
+		}
+		if (!conn.used) {
+			release_buffer(&conn);
+		}
+		if (conn.out.head && flush_output(&conn) < 0) {
+			break;
+		}
+		if (!conn.out.head) {
+			trace_sent(&conn.trace);
+		}
+	}
+	if (conn.streaming && !conn.out.head) {
+		broadcast_subscribe(socket);
 	}
 	//persistent connection close
-	printf("connection closed\n");
+	accesslog_write(LOG_CLOSE, peer, NOTA, 0, 0, 0);
+	capture_close(conn.capture);
 
-	free(request_string);
-	if (response_string) {
-		free(response_string);
+	if (TASK_RUNNING(&conn.handler.task)) {
+		task_cancel(&conn.tasks, &conn.handler.task);
+		admission_end();
+	}
+	h2_free(&conn);
+	task_loop_free(&conn.tasks);
+	trace_release();
+	outq_clear(&conn.out);
+	release_buffer(&conn);
+	free(conn.body);
+	if (conn.tls) {
+		tls_close(conn.tls);
 	}
 } 
 
@@ -113,15 +649,36 @@ void parse_request(char* buffer, request_info* request, int len){
 	request->transfer_encoding = http_parse_header_field(buffer, len, "Transfer-Encoding");
 	request->cookie = http_parse_header_field(buffer, len, "Cookie");
 	request->if_modified_since = http_parse_header_field(buffer, len, "If-Modified-Since");
+	request->if_none_match = http_parse_header_field(buffer, len, "If-None-Match");
+	request->range = http_parse_header_field(buffer, len, "Range");
+	request->if_range = http_parse_header_field(buffer, len, "If-Range");
+	request->accept_encoding = http_parse_header_field(buffer, len, "Accept-Encoding");
+	request->upgrade = http_parse_header_field(buffer, len, "Upgrade");
+	request->http2_settings = http_parse_header_field(buffer, len, "HTTP2-Settings");
+	request->forwarded_for = http_parse_header_field(buffer, len, "X-Forwarded-For");
 	request->parameters = http_parse_path(http_parse_uri(buffer));
+	request->body = NULL;
+}
+
+/*
+ * Sets 'client' to whom 'request' is made for: the peer, or behind a
+ * local proxy on the Unix socket, the client it forwarded it for.
+ */
+void find_client(const log_peer* peer, const request_info* request, log_peer* client) {
+	if (peer->family != AF_UNIX || !request->forwarded_for ||
+		listener_forwarded_peer(client, request->forwarded_for) == -1) {
+		*client = *peer;
+	}
 }
 
 command_type parse_command(char* uri){
-	char* command_types[] = {"/login" , "/logout" , "/servertime", "/browser", "/redirect","/getfile","/putfile","/addcart","/delcart","/checkout", "/close"};
 	command_type c;
-	for (c =0; c<NOTA;c++)
-		if (!strncasecmp(uri, command_types[c], strlen(command_types[c])))
+	for (c =0; c<NOTA;c++) {
+		size_t len = strlen(command_str[c]);
+		//the whole path and not a prefix of it, /getfiles is not /getfile
+		if (!strncasecmp(uri, command_str[c], len) && (uri[len] == '\0' || uri[len] == '?'))
 			return c;
+	}
 	return NOTA;
 }
 
@@ -177,14 +734,14 @@ void command_not_found(request_info* request, response_info* response){
 	set_content_length(response);
 }
 
-void handle_login(request_info* request, response_info* response) {
-	char* user_id = extract_parameter(request->parameters, "username");	
-	printf("welcome %s\n", user_id);
+task_status handle_login(request_handler* h) {
+	response_info* response = &h->response;
+
+	char* user_id = params_get(&h->query, "username");
 	if (user_id) {
 		char* max_age = "86400"; //24*60*60 i.e. 24 hours
 		response->set_cookie = build_cookie_string("username", user_id, max_age, "/");
 		response->body = user_logged_in(user_id);
-		free(user_id);
 	} else {
 		response->status_code = "403";
 		response->status_msg = "Forbidden";
@@ -193,13 +750,15 @@ void handle_login(request_info* request, response_info* response) {
 
 	response->cache_control = "no-cache";
 	set_content_length(response);
-
+	return TASK_DONE;
 }
 
-void handle_logout(request_info* request, response_info* response) {
+task_status handle_logout(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
 	response->cache_control = "no-cache";
 	char* user_id = extract_cookie(request->cookie, "username");
-	printf("bye bye %s\n", user_id);
 	if (user_id) {
 		const char* pre = "User ";
 		const char* post = " was logged out.\n";
@@ -217,22 +776,39 @@ void handle_logout(request_info* request, response_info* response) {
 	}
 
 	set_content_length(response);
-
+	return TASK_DONE;
 }
 
-void handle_servertime(request_info* request, response_info* response) {
+task_status handle_servertime(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
 
 	time_t rawtime;
 	time(&rawtime);
 
+	//server-sent events, a client that cannot be streamed to reconnects for each
+	char* stream = params_get(&h->query, "stream");
+	if (stream && !strcmp(stream, "1")) {
+		response->body = broadcast_event(&rawtime, 1);
+		response->content_type = "text/event-stream";
+		response->event_stream = 1;
+		set_content_length(response);
+		response->cache_control = "no-cache";
+		return TASK_DONE;
+	}
+
 	response->body = get_local_time_string(&rawtime);
 	prepend_user_to_body(request, response);
 
 	set_content_length(response);
 	response->cache_control = "no-cache";
+	return TASK_DONE;
 }
 
-void handle_browser(request_info* request, response_info* response){	
+task_status handle_browser(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
 	char* userAgent = request->user_agent;
 	if (userAgent== NULL){
 		command_forbidden(response);
@@ -242,114 +818,553 @@ void handle_browser(request_info* request, response_info* response){
 	prepend_user_to_body(request, response);
 	set_content_length(response);
 	response->cache_control = "private";
+	return TASK_DONE;
 }
 
-void handle_redirect (request_info* request, response_info* response){	
+task_status handle_redirect(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
 	response->status_code = "303";
 	response->status_msg = "See Other"; 
-	response->location = extract_parameter(request->parameters, "url");
+	response->location = params_get(&h->query, "url");
 	if (response->location == NULL){
 		command_forbidden(response);
 	}
 	//prepend_user_to_body(request, response);
 	response->body = request->user_agent;
 	set_content_length(response);
+	return TASK_DONE;
 }
 
-void handle_getfile(request_info* request, response_info* response){
-	char* filename_encoded = extract_parameter(request->parameters, "filename");
-	if (!filename_encoded) {
-		command_forbidden(response);
+void file_not_found(request_info* request, response_info* response) {
+	response->status_code = "404";
+	response->status_msg = "Not Found";
+	response->body = "HTTP 404, not found";
+	prepend_user_to_body(request, response);
+	set_content_length(response);
+}
 
-		prepend_user_to_body(request, response);
-		set_content_length(response);
-		return;
-	}
+/*
+ * Strong validator made of the inode, size and modification time, so
+ * it changes whenever the file is replaced or rewritten.
+ */
+char* build_etag(const struct stat* filestatus, const char* encoding) {
+	char* etag = (char*)malloc(80);
+	snprintf(etag, 80, "\"%lx-%lx-%lx.%lx%s%s\"", (unsigned long)filestatus->st_ino,
+		(unsigned long)filestatus->st_size, (unsigned long)filestatus->st_mtim.tv_sec,
+		(unsigned long)filestatus->st_mtim.tv_nsec, encoding ? "-" : "", encoding ? encoding : "");
+	return etag;
+}
 
-	char* filename = decode(filename_encoded, (char*)malloc(strlen(filename_encoded)+1));
-	struct stat filestatus;
-    	stat(filename, &filestatus);
+// true if 'etag' is listed in an If-None-Match value (weak comparison)
+int etag_listed(const char* list, const char* etag) {
+	int etag_len = strlen(etag);
 
-	response->last_modified = get_local_time_string(&filestatus.st_ctime);
+	while (*list) {
+		while (*list == ' ' || *list == ',') list++;
+		if (*list == '*') {
+			return 1;
+		}
+		if (!strncmp(list, "W/", 2)) {
+			list += 2;
+		}
+		if (!strncmp(list, etag, etag_len) && (list[etag_len] == '\0' || list[etag_len] == ',' || list[etag_len] == ' ')) {
+			return 1;
+		}
+		while (*list && *list != ',') list++;
+	}
+	return 0;
+}
 
+/*
+ * Decides whether a conditional GET can be answered with 304. As in RFC
+ * 7232, If-Modified-Since is only looked at without If-None-Match.
+ */
+int not_modified(request_info* request, const char* etag, time_t mtime) {
+	if (request->if_none_match) {
+		return etag_listed(request->if_none_match, etag);
+	}
 	if (request->if_modified_since) {
-		struct tm since_time;
-		strptime(request->if_modified_since, "%a, %d %b %Y %T %Z", &since_time);
+		time_t since;
+		return http_parse_date(request->if_modified_since, &since) == 0 && mtime <= since;
+	}
+	return 0;
+}
+
+/*
+ * True if the Accept-Encoding value 'accept' allows 'coding', either by
+ * name or through "*", and does not give it a q-value of zero.
+ */
+int accepts_encoding(const char* accept, const char* coding) {
+	int coding_len = strlen(coding);
+	int allowed = 0;
+
+	while (*accept) {
+		while (*accept == ' ' || *accept == ',') accept++;
+		const char* token = accept;
+		while (*accept && *accept != ',' && *accept != ';' && *accept != ' ') accept++;
+		int token_len = accept - token;
+
+		float q = 1;
+		while (*accept && *accept != ',') {
+			if (*accept == ';') {
+				while (*++accept == ' ');
+				if (*accept == 'q' && accept[1] == '=') {
+					q = atof(accept+2);
+				}
+			} else {
+				accept++;
+			}
+		}
 
+		if (token_len == coding_len && !strncasecmp(token, coding, coding_len)) {
+			return q > 0;
+		}
+		if (token_len == 1 && *token == '*') {
+			allowed = q > 0;
+		}
+	}
+	return allowed;
+}
 
-		if (filestatus.st_ctime <= mktime(&since_time)) {
-			response->status_code = "304";
-			response->status_msg = "Not Modified";
-			response->body = "HTTP 304 Not Modified";
+/*
+ * Picks the encoded representation of 'filename' to send, if the
+ * client accepts one: a precompressed .zst or .gz sibling that is at
+ * least as new as the file, else a gzip copy from the file cache. The
+ * cache entry may still have to be produced, in which case '*fill' is
+ * set. Returns the path to open and fills in its status in 'variant'.
+ */
+char* select_encoding(request_info* request, response_info* response, char* filename,
+		struct stat* filestatus, struct stat* variant, int* fill) {
+	static char* siblings[][2] = {{"zstd", ".zst"}, {"gzip", ".gz"}};
+	unsigned int i;
+
+	response->vary = "Accept-Encoding";
+	*variant = *filestatus;
+	*fill = 0;
+
+	for (i = 0; i < sizeof(siblings)/sizeof(siblings[0]); i++) {
+		if (!accepts_encoding(request->accept_encoding, siblings[i][0])) {
+			continue;
+		}
+		char* path = (char*)malloc(strlen(filename)+strlen(siblings[i][1])+1);
+		strcpy(path, filename);
+		strcat(path, siblings[i][1]);
+		if (stat(path, variant) == 0 && S_ISREG(variant->st_mode) && variant->st_mtime >= filestatus->st_mtime) {
+			response->content_encoding = siblings[i][0];
+			return path;
+		}
+		free(path);
+	}
+	*variant = *filestatus;
 
-			prepend_user_to_body(request, response);
-			set_content_length(response);
+	if (!accepts_encoding(request->accept_encoding, "gzip") || filestatus->st_size < FILECACHE_MIN_SIZE
+			|| filestatus->st_size > FILECACHE_MAX_SIZE) {
+		return filename;
+	}
+	char* cache_path = filecache_path(filename, filestatus, "gzip");
+	if (!cache_path) {
+		return filename;
+	}
+	switch (filecache_lookup(cache_path, variant)) {
+		case FILECACHE_MISS:
+			*fill = 1;
+			//fall through
+		case FILECACHE_HIT:
+			response->content_encoding = "gzip";
+			return cache_path;
+		default:
+			*variant = *filestatus;
+			free(cache_path);
+			return filename;
+	}
+}
 
-			return;
-		} 
+char* format_offset(const char* format, off_t a, off_t b, off_t c) {
+	int len = snprintf(NULL, 0, format, (long long)a, (long long)b, (long long)c);
+	char* str = (char*)malloc(len+1);
+	snprintf(str, len+1, format, (long long)a, (long long)b, (long long)c);
+	return str;
+}
+
+/*
+ * Parses a "bytes=" Range header against a file of 'size' bytes.
+ * Returns the number of satisfiable ranges stored in 'ranges', 0 if
+ * none of them can be satisfied, or -1 if the header should be ignored
+ * (malformed, another unit, or too many ranges).
+ */
+int parse_ranges(const char* header, off_t size, byte_range* ranges) {
+	int count = 0;
+
+	if (strncasecmp(header, "bytes=", 6)) {
+		return -1;
 	}
+	header += 6;
 
-	FILE* fd;
-	fd = fopen(filename, "r");
+	while (*header) {
+		long long first = -1, last = -1;
+		char* end;
 
-	if (fd != NULL) {
-		response->transfer_encoding = "chunked";
-		response->content_type = "application/octet-stream";
-		int buffer_size = 100;
-		char buffer[buffer_size];
+		while (*header == ' ' || *header == ',') header++;
+		if (!*header) {
+			break;
+		}
+
+		if (*header == '-') {
+			//suffix range: the last N bytes
+			long long suffix = strtoll(header+1, &end, 10);
+			if (end == header+1 || suffix < 0) {
+				return -1;
+			}
+			first = suffix >= size ? 0 : size-suffix;
+			last = size-1;
+			if (suffix == 0) {
+				first = size;
+			}
+		} else {
+			first = strtoll(header, &end, 10);
+			if (end == header || *end != '-' || first < 0) {
+				return -1;
+			}
+			header = end+1;
+			last = strtoll(header, &end, 10);
+			if (end == header) {
+				last = size-1;
+			} else if (last < first) {
+				return -1;
+			}
+			if (last >= size) {
+				last = size-1;
+			}
+		}
+		header = end;
+		while (*header == ' ') header++;
+		if (*header && *header != ',') {
+			return -1;
+		}
 
-		int read_bytes = fread(buffer, sizeof(char), buffer_size-3, fd);
-		response->body = (char*)malloc(1);
-		response->body[0] = '\0';
-		while (read_bytes) {
-			append(&(response->body), hitoa(read_bytes));
-			append(&(response->body), "\r\n");
-			buffer[read_bytes++]='\r';
-			buffer[read_bytes++] = '\n';
-			buffer[read_bytes] ='\0';
-			append(&(response->body), buffer);
-			read_bytes = fread(buffer, sizeof(char), buffer_size-3, fd);
+		if (first < size) {
+			if (count == MAX_RANGES) {
+				return -1;
+			}
+			ranges[count].first = first;
+			ranges[count].last = last;
+			count++;
 		}
+	}
+	return count;
+}
+
+/*
+ * A Range is only honoured if the If-Range validator, when present,
+ * still matches the file: a strong ETag or the exact Last-Modified.
+ */
+int range_applies(request_info* request, response_info* response) {
+	const char* if_range = request->if_range;
+
+	if (!if_range) {
+		return 1;
+	}
+	if (*if_range == '"') {
+		return !strcmp(if_range, response->etag);
+	}
+	return !strcmp(if_range, response->last_modified);
+}
+
+void set_ranges(request_info* request, response_info* response, off_t size) {
+	int count = parse_ranges(request->range, size, response->ranges);
 
-		append(&(response->body), "0\r\n\r\n");
+	if (count < 0) {
+		return;
+	}
+
+	if (count == 0) {
+		if (response->file_fd >= 0) {
+			close(response->file_fd);
+		}
+		response->file_fd = -1;
+		response->data = NULL;
+		response->status_code = "416";
+		response->status_msg = "Range Not Satisfiable";
+		response->content_range = format_offset("bytes */%lld", size, 0, 0);
+		response->content_type = NULL;
+		response->content_length = "0";
+		return;
+	}
 
+	response->status_code = "206";
+	response->status_msg = "Partial Content";
+	response->num_ranges = count;
+
+	if (count == 1) {
+		byte_range* range = &response->ranges[0];
+		response->file_offset = range->first;
+		response->file_length = range->last-range->first+1;
+		response->content_range = format_offset("bytes %lld-%lld/%lld", range->first, range->last, size);
+		response->content_length = format_offset("%lld", response->file_length, 0, 0);
+		return;
+	}
+
+	//each part gets its own header, the last entry closes the multipart body
+	const char* boundary = "CSHTTP_BYTERANGES";
+	off_t total = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		byte_range* range = &response->ranges[i];
+		char* range_str = format_offset("%lld-%lld/%lld", range->first, range->last, size);
+		int len = snprintf(NULL, 0, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %s\r\n\r\n",
+			boundary, response->content_type, range_str);
+		response->part_headers[i] = (char*)malloc(len+1);
+		sprintf(response->part_headers[i], "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %s\r\n\r\n",
+			boundary, response->content_type, range_str);
+		free(range_str);
+		total += len + range->last-range->first+1;
+	}
+	int len = snprintf(NULL, 0, "\r\n--%s--\r\n", boundary);
+	response->part_headers[count] = (char*)malloc(len+1);
+	sprintf(response->part_headers[count], "\r\n--%s--\r\n", boundary);
+	total += len;
+
+	response->content_type = "multipart/byteranges; boundary=CSHTTP_BYTERANGES";
+	response->content_length = format_offset("%lld", total, 0, 0);
+}
+
+//runs in a helper, compressing a large file can take a while
+static int fill_cache(void* arg) {
+	request_handler* h = (request_handler*)arg;
+	return filecache_fill(h->filename, h->path, "gzip", &h->variant);
+}
+
+/*
+ * Answers from the asset bundle if the file was packed into it, straight
+ * from the mapping and without a single file system call. Returns 0 if
+ * it was not.
+ */
+static int serve_bundled(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+	const bundle_asset* asset = bundle_lookup(h->filename);
+
+	if (!asset) {
+		return 0;
+	}
+	//ranges are always served from the identity body, as from files
+	const bundle_variant* variant = &asset->variants[BUNDLE_IDENTITY];
+	if (asset->variants[BUNDLE_GZIP].length) {
+		response->vary = "Accept-Encoding";
+		if (request->accept_encoding && !request->range && accepts_encoding(request->accept_encoding, "gzip")) {
+			variant = &asset->variants[BUNDLE_GZIP];
+			response->content_encoding = "gzip";
+		}
+	}
+	response->etag = (char*)bundle_at(variant->etag);
+	response->last_modified = (char*)bundle_at(asset->last_modified);
+
+	if (not_modified(request, response->etag, asset->mtime)) {
+		response->status_code = "304";
+		response->status_msg = "Not Modified";
+		response->content_type = NULL;
+		return 1;
+	}
+
+	response->content_type = (char*)bundle_at(asset->content_type);
+	response->content_length = (char*)bundle_at(variant->content_length);
+	response->data = bundle_at(variant->body);
+	response->file_length = variant->length;
+	if (!response->content_encoding) {
+		response->accept_ranges = "bytes";
+	}
+	if (request->range && range_applies(request, response)) {
+		set_ranges(request, response, variant->length);
 	} else {
-		response->status_code = "404";
-		response->status_msg = "Not Found";
-		response->body = "HTTP 404, not found";
+		response->headers = bundle_at(variant->headers);
+		response->headers_len = variant->headers_len;
+	}
+	return 1;
+}
+
+task_status handle_getfile(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
+	TASK_BEGIN(&h->task);
+	h->filename = params_get(&h->query, "filename");
+	if (!h->filename) {
+		command_forbidden(response);
+
 		prepend_user_to_body(request, response);
 		set_content_length(response);
+		TASK_RETURN(&h->task);
+	}
+
+	if (serve_bundled(h)) {
+		TASK_RETURN(&h->task);
+	}
+
+	if (stat(h->filename, &h->filestatus) == -1 || !S_ISREG(h->filestatus.st_mode)) {
+		file_not_found(request, response);
+		TASK_RETURN(&h->task);
+	}
+
+	//ranges are always served from the file itself
+	h->path = h->filename;
+	h->variant = h->filestatus;
+	h->fill = 0;
+	if (request->accept_encoding && !request->range) {
+		h->path = select_encoding(request, response, h->filename, &h->filestatus, &h->variant, &h->fill);
+	}
+
+	response->etag = build_etag(&h->filestatus, response->content_encoding);
+	response->last_modified = get_gm_time_string(&h->filestatus.st_mtime);
+
+	//answer revalidations before the file is even opened
+	if (not_modified(request, response->etag, h->filestatus.st_mtime)) {
+		response->status_code = "304";
+		response->status_msg = "Not Modified";
+		response->content_type = NULL;
+		TASK_RETURN(&h->task);
+	}
+
+	if (h->fill) {
+		TASK_AWAIT(&h->task, task_offload(h->loop, &h->task, fill_cache, h));
+		if (h->task.result != FILECACHE_HIT) {
+			//not worth compressing after all, send it as it is
+			h->path = h->filename;
+			response->content_encoding = NULL;
+			response->etag = build_etag(&h->filestatus, NULL);
+		}
+	}
+
+	int fd = open(h->path, O_RDONLY);
+
+	if (fd != -1 && fstat(fd, &h->variant) == 0) {
+		//the body is sent straight from the file by the output queue
+		response->content_type = "application/octet-stream";
+		response->file_fd = fd;
+		response->file_length = h->variant.st_size;
+		response->content_length = format_offset("%lld", h->variant.st_size, 0, 0);
+
+		if (!response->content_encoding) {
+			response->accept_ranges = "bytes";
+		}
+		if (request->range && range_applies(request, response)) {
+			set_ranges(request, response, h->variant.st_size);
+		}
+	} else {
+		file_not_found(request, response);
 	}
+	TASK_END(&h->task);
 }
 
-void handle_putfile(request_info* request, response_info* response){
+#define PARTS_BOUNDARY "CSHTTP_FILES"
 
-	response->cache_control = "no-cache";
-	char* filename = extract_parameter(request->body, "filename");
+//the delimiter and header fields of a part, 'name' is left out if it would break them
+static char* part_header(const char* name, const char* fields, off_t length) {
+	const char* boundary = PARTS_BOUNDARY;
+	const char* location = strpbrk(name, "\r\n") ? "" : name;
+	int len = snprintf(NULL, 0, "\r\n--%s\r\nContent-Location: %s\r\n%sContent-Length: %lld\r\n\r\n",
+		boundary, location, fields, (long long)length);
+	char* header = (char*)malloc(len+1);
 
-	if (!filename) {
-		command_forbidden(response);
+	sprintf(header, "\r\n--%s\r\nContent-Location: %s\r\n%sContent-Length: %lld\r\n\r\n",
+		boundary, location, fields, (long long)length);
+	return header;
+}
 
+/*
+ * Answers /getfiles?filename=A&filename=B... with all of the files, in
+ * that order, as one multipart/mixed response. Files in the asset
+ * bundle are sent from it, the others straight from the file, and
+ * those that cannot be read get an empty part saying so.
+ */
+task_status handle_getfiles(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+	char* filenames[MAX_PARTS];
+	int count = params_get_all(&h->query, "filename", filenames, MAX_PARTS);
+	off_t total = 0;
+	int i;
+
+	if (!count) {
+		command_forbidden(response);
 		prepend_user_to_body(request, response);
 		set_content_length(response);
-		return;
+		return TASK_DONE;
 	}
 
-	int filename_len = strlen(filename);
+	response->parts = (file_part*)calloc(count+1, sizeof(file_part));
+	response->num_parts = count+1;
+	for (i = 0; i < count; i++) {
+		file_part* part = &response->parts[i];
+		const bundle_asset* asset = bundle_lookup(filenames[i]);
+		struct stat filestatus;
+
+		part->file_fd = -1;
+		//opened without blocking, so that a FIFO is refused like any other file that is not regular
+		if (asset) {
+			part->data = bundle_at(asset->variants[BUNDLE_IDENTITY].body);
+			part->length = asset->variants[BUNDLE_IDENTITY].length;
+		} else if ((part->file_fd = open(filenames[i], O_RDONLY | O_NONBLOCK)) != -1 &&
+			(fstat(part->file_fd, &filestatus) == -1 || !S_ISREG(filestatus.st_mode))) {
+			close(part->file_fd);
+			part->file_fd = -1;
+		}
+
+		if (asset || part->file_fd != -1) {
+			part->length = asset ? part->length : filestatus.st_size;
+			part->headers = part_header(filenames[i], "Content-Type: application/octet-stream\r\n", part->length);
+		} else {
+			part->headers = part_header(filenames[i], "Status: 404 Not Found\r\n", 0);
+		}
+		total += strlen(part->headers) + part->length;
+	}
+	response->parts[count].file_fd = -1;
+	response->parts[count].headers = strdup("\r\n--" PARTS_BOUNDARY "--\r\n");
+	total += strlen(response->parts[count].headers);
+
+	response->content_type = "multipart/mixed; boundary=" PARTS_BOUNDARY;
+	response->content_length = format_offset("%lld", total, 0, 0);
+	return TASK_DONE;
+}
 
+//a small write, done inline: a helper would cost more than it saves
+static int save_file(const char* filename, const char* content) {
 	FILE * fd;
 	fd = fopen (filename,"w");
-	if (fd != NULL) {
-		char* content = extract_parameter(request->body, "content");
+	if (fd == NULL) {
+		return -1;
+	}
+	if (content) {
 		fputs(content, fd);
-		fclose(fd);
-		free(content);
+	}
+	fclose(fd);
+	return 0;
+}
+
+task_status handle_putfile(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
 
+	response->cache_control = "no-cache";
+	params_parse(&h->form, (char*)request->body);
+	h->filename = params_get(&h->form, "filename");
+
+	if (!h->filename) {
+		command_forbidden(response);
+
+		prepend_user_to_body(request, response);
+		set_content_length(response);
+		return TASK_DONE;
+	}
+
+	if (save_file(h->filename, params_get(&h->form, "content")) == 0) {
 		char* save_success = " has been saved successfully.";
-		filename = (char*)realloc(filename, filename_len+strlen(save_success));
-		strcpy(filename+filename_len, save_success);
+		char* body = (char*)malloc(strlen(h->filename)+strlen(save_success)+1);
+		strcpy(body, h->filename);
+		strcat(body, save_success);
 
-		response->body = filename;
+		response->body = body;
 		set_content_length(response);
 	} else {
 		response->status_code = "403";
@@ -358,7 +1373,7 @@ void handle_putfile(request_info* request, response_info* response){
 	}
 	prepend_user_to_body(request, response);
 	set_content_length(response);
-
+	return TASK_DONE;
 }
 
 char* get_free_item(request_info* request){
@@ -415,9 +1430,12 @@ char* get_cookie_list(request_info* request, char* item, int del_index){
 	return cookie_list;
 }
 
-void handle_addcart(request_info* request, response_info* response){
+task_status handle_addcart(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
 	response->cache_control = "no-cache";
-	char* item = extract_parameter(request->parameters, "item");
+	char* item = params_get(&h->query, "item");
 	if (item == NULL){
 		command_forbidden(response);
 	} else{
@@ -431,12 +1449,16 @@ void handle_addcart(request_info* request, response_info* response){
 	}
 	prepend_user_to_body(request, response);
 	set_content_length(response);
+	return TASK_DONE;
 }
 
-void handle_delcart(request_info* request, response_info* response){
+task_status handle_delcart(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
 	response->cache_control = "no-cache";
 	char* item_names[] = {"item1","item2","item3","item4","item5","item6","item7","item8","item9","item10","item11","item12"};	
-	char* item = extract_parameter(request->parameters, "itemnr");
+	char* item = params_get(&h->query, "itemnr");
 
 	if (item == NULL){
 		command_forbidden(response);
@@ -459,9 +1481,31 @@ void handle_delcart(request_info* request, response_info* response){
 	}
 	prepend_user_to_body(request, response);
 	set_content_length(response);
+	return TASK_DONE;
 }
 
-void handle_checkout(request_info* request, response_info* response){
+//stores the order in the cart of the logged in user
+static int journal_checkout(request_info* request) {
+	char* item_names[] = {"item1","item2","item3","item4","item5","item6","item7","item8","item9","item10","item11","item12"};
+	char* items[ORDERS_MAX_ITEMS];
+	char* user_id = extract_cookie(request->cookie, "username");
+	int num_items = 0;
+
+	while (num_items < ORDERS_MAX_ITEMS && (items[num_items] = extract_cookie(request->cookie, item_names[num_items]))) {
+		num_items++;
+	}
+	int result = orders_append(user_id, items, num_items);
+	while (num_items--) {
+		free(items[num_items]);
+	}
+	free(user_id);
+	return result;
+}
+
+task_status handle_checkout(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
 	response->cache_control = "no-cache";
 	char* item_names[] = {"item1","item2","item3","item4","item5","item6","item7","item8","item9","item10","item11","item12"};	
 	char* user_id = extract_cookie(request->cookie, "username");
@@ -474,13 +1518,6 @@ void handle_checkout(request_info* request, response_info* response){
 		response->body = get_cookie_list(request, NULL, 14);
 		prepend_user_to_body(request, response);
 
-		//make a file or append a file		
-		FILE * fd;
-		char* filename = "CHECKOUT.txt";
-		fd = fopen (filename,"a");
-		fputs(response->body, fd);
-		fclose(fd);
-
 		//delete all item cookies
 		int extra = 0;
 		while(has_cookie(request->cookie, item_names[extra])){
@@ -488,28 +1525,83 @@ void handle_checkout(request_info* request, response_info* response){
 			extra++;
 		}
 		response->num_extra_cookies = extra;	
+
+		if (journal_checkout(request) != 0) {
+			//keep the cart, the order can be placed again
+			response->status_code = "500";
+			response->status_msg = "Internal Server Error";
+			response->body = "The order could not be stored\n";
+			response->num_extra_cookies = 0;
+		}
 	}
 
 	set_content_length(response);
+	return TASK_DONE;
+}
+
+task_status handle_orders(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
+	response->cache_control = "no-cache";
+	char* user_id = extract_cookie(request->cookie, "username");
+	if (!user_id){
+		response->status_code = "403";
+		response->status_msg = "Forbidden";
+		response->body = "User must be logged in to see their orders\n";
+	} else{
+		response->body = orders_list(user_id);
+		if (!response->body) {
+			response->body = "No orders yet\n";
+		}
+		free(user_id);
+	}
+	prepend_user_to_body(request, response);
+	set_content_length(response);
+	return TASK_DONE;
 }
 
-void handle_close(request_info* request, response_info* response){
+task_status handle_close(request_handler* h) {
+	request_info* request = h->request;
+	response_info* response = &h->response;
+
 	response->connection = "close";
 	response->body = "The connection will now be closed.";
 	prepend_user_to_body(request, response);
 	set_content_length(response);
 	response->cache_control = "private";
+	return TASK_DONE;
 }
 
 
-void build_response(request_info* request, response_info* response){
+static task_status (*handlers[])(request_handler* h) = {
+	handle_login, handle_logout, handle_servertime, handle_browser,
+	handle_redirect, handle_getfile, handle_putfile, handle_addcart,
+	handle_delcart, handle_checkout, handle_close, handle_orders,
+	handle_getfiles
+};
 
-	memset(response, 0, sizeof(response_info));
+static task_status handle_not_found(request_handler* h) {
+	command_not_found(h->request, &h->response);
+	return TASK_DONE;
+}
+
+/*
+ * Prepares 'h' to answer 'request', offloading blocking operations to
+ * 'loop'. The response is complete once handler_run() returns TASK_DONE.
+ */
+void handler_start(request_handler* h, request_info* request, task_loop* loop){
+	response_info* response = &h->response;
+
+	memset(h, 0, sizeof(request_handler));
+	h->request = request;
+	h->loop = loop;
 	response->info = request;
+	response->file_fd = -1;
 
 	//set some common fields that are true for most requests
 	response->content_type = "text/plain";
-	response->connection = request->connection;
+	response->connection = request->connection ? request->connection : "keep-alive";
 	response->cache_control = "public";
 	response->status_code = "200";
 	response->status_msg = "OK";
@@ -523,92 +1615,151 @@ void build_response(request_info* request, response_info* response){
 		return;
 	}
 
-	switch(request->command){
-		case LOGIN:
-			handle_login(request, response);
-			break;
-		case LOGOUT:
-			handle_logout(request, response);
-			break;
-		case SERVERTIME:
-			handle_servertime(request, response);
-			break;
-		case BROWSER:
-			handle_browser(request, response);
-			break;
-		case REDIRECT:
-			handle_redirect(request, response);
-			break;
-		case GET_FILE:
-			handle_getfile(request, response);
-			break;
-		case PUT_FILE:
-			handle_putfile(request, response);
-			break;
-		case ADD_CART:
-			handle_addcart(request, response);
-			break;
-		case DEL_CART:
-			handle_delcart(request, response);
-			break;
-		case CHECKOUT:
-			handle_checkout(request, response);
-			break;
-		case CLOSE:
-			handle_close(request, response);
-			break;
-		default:
-			command_not_found(request, response);
-	}
+	char* query = request->parameters ? strchr(request->parameters, '?') : NULL;
+	params_parse(&h->query, query ? query+1 : NULL);
+	h->run = request->command < NOTA ? handlers[request->command] : handle_not_found;
 }
 
-char* print_response(response_info* response){
-	char* response_string = new_response_header(response->status_code, response->status_msg);
-
-	time_t raw_time;
-	time(&raw_time);
-	char* time_string = get_gm_time_string(&raw_time);
-	add_header_field(&response_string, "Date", time_string);
-
-	add_header_field(&response_string, "Connection", response->connection);
+task_status handler_run(request_handler* h){
+	if (h->task.waiting) {
+		return TASK_PENDING;
+	}
+	//resumed: the time since it was suspended went to the helper
+	if (TASK_RUNNING(&h->task)) {
+		trace_phase(h->trace, TRACE_HELPER);
+	}
+	alloc_attribute(h->request->command);
+	task_status status = h->run ? h->run(h) : TASK_DONE;
+	trace_phase(h->trace, TRACE_HANDLER);
+	return status;
+}
 
-	add_header_field(&response_string, "Cache-Control", response->cache_control);
+//the header fields that do not change from one time a response is sent to the next
+static void emit_response_fields(response_info* response, header_emitter emit, void* ctx){
+	emit(ctx, "Cache-Control", response->cache_control);
 
 	if (response->content_length) {
-		add_header_field(&response_string, "Content-Length", response->content_length);
-	} else {
-		add_header_field(&response_string, "Transfer-Encoding", response->transfer_encoding);
+		emit(ctx, "Content-Length", response->content_length);
+	} else if (response->transfer_encoding) {
+		emit(ctx, "Transfer-Encoding", response->transfer_encoding);
 	}
 
-	add_header_field(&response_string, "Content-Type", response->content_type);
+	if (response->content_type) {
+		emit(ctx, "Content-Type", response->content_type);
+	}
 
 	if (response->set_cookie) {
-		add_header_field(&response_string, "Set-Cookie", response->set_cookie);
+		emit(ctx, "Set-Cookie", response->set_cookie);
 	}
 	if (response->num_extra_cookies >0){
 		int i;		
 		for(i= 0; i<response->num_extra_cookies; i++){
-			add_header_field(&response_string, "Set-Cookie", response->more_cookies[i]);	
+			emit(ctx, "Set-Cookie", response->more_cookies[i]);	
 		}
 	}
 
 	if (response->location) {
-		add_header_field(&response_string, "Location", response->location);
+		emit(ctx, "Location", response->location);
 	}
 
 	if (response->last_modified){
-		add_header_field(&response_string, "Last-Modified", response->last_modified);
+		emit(ctx, "Last-Modified", response->last_modified);
+	}
+
+	if (response->etag) {
+		emit(ctx, "ETag", response->etag);
+	}
+
+	if (response->accept_ranges) {
+		emit(ctx, "Accept-Ranges", response->accept_ranges);
+	}
+
+	if (response->content_range) {
+		emit(ctx, "Content-Range", response->content_range);
+	}
+
+	if (response->content_encoding) {
+		emit(ctx, "Content-Encoding", response->content_encoding);
+	}
+
+	if (response->vary) {
+		emit(ctx, "Vary", response->vary);
 	}
 
 	if (response->allow) {
-		add_header_field(&response_string, "Allow", response->allow);
+		emit(ctx, "Allow", response->allow);
+	}
+
+	if (response->retry_after) {
+		emit(ctx, "Retry-After", response->retry_after);
 	}
+}
+
+/*
+ * Hands every header field of 'response' to 'emit', in the order they
+ * are sent. Shared by the HTTP/1.1 and HTTP/2 serializers.
+ */
+void emit_response_headers(response_info* response, header_emitter emit, void* ctx){
+	time_t raw_time;
+	time(&raw_time);
+	char* time_string = get_gm_time_string(&raw_time);
+	emit(ctx, "Date", time_string);
+
+	emit(ctx, "Connection", response->connection);
+
+	emit_response_fields(response, emit, ctx);
+
+	free(time_string);
+}
+
+static void add_header_emitter(void* ctx, const char* name, const char* value) {
+	add_header_field((char**)ctx, name, value);
+}
+
+/*
+ * The status line, Date and Connection of a response whose other
+ * header fields were rendered ahead of time, see bundle.h.
+ */
+char* print_response_start(response_info* response){
+	char* response_string = new_response_header(response->status_code, response->status_msg);
+	time_t raw_time;
+	time(&raw_time);
+	char* time_string = get_gm_time_string(&raw_time);
+
+	add_header_field(&response_string, "Date", time_string);
+	add_header_field(&response_string, "Connection", response->connection);
+	free(time_string);
+	return response_string;
+}
+
+/*
+ * Everything print_response() writes after Date and Connection: the
+ * other header fields and the body.
+ */
+char* print_response_fields(response_info* response){
+	char* response_string = strdup("");
+
+	emit_response_fields(response, add_header_emitter, &response_string);
 
 	if (response->body) {
 		add_response_body(&response_string, response->body);
+	} else {
+		append(&response_string, "\n");
 	}
 
-	free(time_string);
+	return response_string;
+}
+
+char* print_response(response_info* response){
+	char* response_string = new_response_header(response->status_code, response->status_msg);
+
+	emit_response_headers(response, add_header_emitter, &response_string);
+
+	if (response->body) {
+		add_response_body(&response_string, response->body);
+	} else {
+		append(&response_string, "\n");
+	}
 
 	return response_string;
 }
@@ -5,14 +5,24 @@
 #ifndef _SERVICE_H_
 #define _SERVICE_H_
 
+#include <signal.h>
+#include <sys/stat.h>
+
 #include "util.h"
+#include "accesslog.h"
+#include "timerwheel.h"
+#include "outqueue.h"
+#include "task.h"
+#include "trace.h"
 
 typedef enum {
     LOGIN, LOGOUT, SERVERTIME, BROWSER,
     REDIRECT, GET_FILE, PUT_FILE, ADD_CART,
-    DEL_CART, CHECKOUT, CLOSE, NOTA
+    DEL_CART, CHECKOUT, CLOSE, ORDERS, GET_FILES, NOTA
 } command_type;
 
+extern const char *command_str[];
+
 typedef struct request_info{
 	http_method req_type;
 	command_type command;
@@ -25,10 +35,34 @@ typedef struct request_info{
 	char* transfer_encoding;
 	char* cookie;
 	char* if_modified_since;
+	char* if_none_match;
+	char* range;
+	char* if_range;
+	char* accept_encoding;
+	char* upgrade;
+	char* http2_settings;
+	char* forwarded_for;
 	const char* parameters;
 	const char* body;
 } request_info;
 
+#define MAX_RANGES 16
+#define MAX_BODY (16*1024*1024)	//bytes of a request body
+#define MAX_PARTS PARAMS_MAX	//files in one /getfiles response
+
+typedef struct byte_range {
+	off_t first;
+	off_t last;
+} byte_range;
+
+//a body of a multipart/mixed response, sent like response_info's own
+typedef struct file_part {
+	char* headers;		//the delimiter and header fields before the body
+	int file_fd;		//-1 if the body is in memory, or empty
+	const char* data;
+	off_t length;
+} file_part;
+
 typedef struct response_info{
 	struct request_info* info;
 	char* status_code;
@@ -40,18 +74,114 @@ typedef struct response_info{
 	char* transfer_encoding;
 	char* location;
 	char* last_modified;
+	char* etag;
+	char* accept_ranges;
+	char* content_range;
+	char* content_encoding;
+	char* vary;
 	char* allow;
+	char* retry_after;
 	char* set_cookie;
 	char* body;
 	char* more_cookies[12];
 	int num_extra_cookies;
+	int file_fd;
+	const char* data;	//body kept in memory for good, sent like a file instead of file_fd
+	off_t file_offset;
+	off_t file_length;
+	const char* headers;	//fields rendered ahead of time, sent after Date and Connection
+	size_t headers_len;
+	int headers_owned;	//'headers' is freed once sent
+	int event_stream;	//the body is the first server-sent event, see broadcast.h
+	byte_range ranges[MAX_RANGES];
+	int num_ranges;
+	char* part_headers[MAX_RANGES+1];
+	file_part* parts;	//the last one only closes the multipart body
+	int num_parts;
 } response_info;
 
-void handle_client(int socket);
+/*
+ * A request being answered. Handlers are task functions (see task.h) so
+ * that they can wait for slow file operations without holding up the
+ * connection; what they need across a wait is kept here.
+ */
+typedef struct request_handler {
+	task task;
+	task_status (*run)(struct request_handler* h);
+	request_info* request;
+	response_info response;
+	task_loop* loop;	//where operations are offloaded, NULL to run them inline
+	trace_span* trace;	//of the request, may be NULL
+	param_map query;	//split in place, see params_parse()
+	param_map form;
+	char* filename;
+	char* path;
+	struct stat filestatus;
+	struct stat variant;
+	int fill;
+} request_handler;
+
+/*
+ * Connection lifecycle limits, in milliseconds and requests. A value
+ * of 0 disables the corresponding limit.
+ */
+typedef struct service_config {
+	int idle_timeout;
+	int max_requests;
+	int max_lifetime;
+} service_config;
+
+extern service_config service_conf;
+
+// set when the server is being replaced: finish what is in flight, then close
+extern volatile sig_atomic_t service_draining;
+
+typedef struct connection {
+	int socket;
+	const log_peer* peer;
+	log_peer client;	//whom the request being answered is for, see find_client()
+	int requests;
+	int expired;		//idle for too long, dropped at once
+	int retired;		//past its lifetime, closed once its responses are sent
+	int closing;
+	int streaming;		//handed to the broadcaster once the response is sent
+	char* buffer;
+	int size;
+	int used;
+	int header_len;		//of the request whose body is being read
+	int consumed;
+	request_info request;
+	char* body;
+	int body_len;
+	int body_used;
+	int64_t started;
+	int64_t received;	//when request bytes were last read
+	outqueue out;
+	timer_wheel timers;
+	timer_entry idle_timer;
+	timer_entry lifetime_timer;
+	struct h2_session* h2;	//set once the connection speaks HTTP/2
+	struct tls_session* tls;	//set if the connection is HTTPS
+	uint64_t capture;	//its number in the traffic capture, 0 if not capturing
+	request_handler handler;	//of the HTTP/1.1 request being answered
+	task_loop tasks;
+	trace_span trace;	//of the last request, until its response is sent
+} connection;
+
+void service_drain(int sig);
+void handle_client(int socket, const log_peer* peer);
+int service(connection* conn);
 void parse_request(char* buffer, request_info* request, int len);
+void find_client(const log_peer* peer, const request_info* request, log_peer* client);
 command_type parse_command(char* uri);
-void build_response(request_info* request, response_info* response);
+void handler_start(request_handler* h, request_info* request, task_loop* loop);
+task_status handler_run(request_handler* h);
+typedef void (*header_emitter)(void* ctx, const char* name, const char* value);
+
+void emit_response_headers(response_info* response, header_emitter emit, void* ctx);
 char* print_response(response_info* response);
+char* print_response_start(response_info* response);
+char* print_response_fields(response_info* response);
 char* forbidden_command();
 char* forbidden_checkout();
 
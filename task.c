@@ -0,0 +1,124 @@
+/*
+ * File: task.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "task.h"
+
+/*
+ * Blocking operations run in a helper process forked for each of them,
+ * which leaves the worker free to serve the rest of the connection in
+ * the meantime. The helper writes its job id and result to the wake
+ * pipe; the result of an operation that was cancelled is dropped, but
+ * its helper is still reaped once it reports.
+ */
+
+typedef struct completion {
+    unsigned id;
+    int result;
+} completion;
+
+void task_loop_init(task_loop *loop) {
+
+    loop->num_jobs = 0;
+    loop->next_id = 0;
+    if (pipe2(loop->wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("task");
+        loop->wake[0] = loop->wake[1] = -1;
+    }
+}
+
+/*
+ * Runs 'operation' on behalf of 't'. Returns 1 if the operation is in
+ * progress, and 0 if it already completed, e.g. because no helper could
+ * be started, with its result in t->result.
+ */
+int task_offload(task_loop *loop, task *t, int (*operation)(void *), void *arg) {
+
+    completion done;
+    pid_t helper = -1;
+
+    if (loop && loop->wake[1] != -1 && loop->num_jobs < TASK_MAX_JOBS) {
+        done.id = ++loop->next_id;
+        helper = fork();
+    }
+    if (helper == 0) {
+        done.result = operation(arg);
+        // a completion is far smaller than PIPE_BUF, so it is written whole
+        while (write(loop->wake[1], &done, sizeof(done)) == -1 && errno == EAGAIN) usleep(1000);
+        _exit(0);
+    }
+    if (helper == -1) {
+        t->result = operation(arg);
+        t->waiting = 0;
+        return 0;
+    }
+
+    task_job *job = &loop->jobs[loop->num_jobs++];
+    job->id = done.id;
+    job->task = t;
+    job->helper = helper;
+    t->job = done.id;
+    t->waiting = 1;
+    return 1;
+}
+
+/*
+ * Takes the completions reported so far, so that the tasks waiting on
+ * them can be resumed.
+ */
+void task_loop_collect(task_loop *loop) {
+
+    completion done;
+    int i;
+
+    while (read(loop->wake[0], &done, sizeof(done)) == sizeof(done)) {
+        for (i = 0; i < loop->num_jobs; i++) {
+            task_job *job = &loop->jobs[i];
+            if (job->id != done.id) continue;
+            if (job->task) {
+                job->task->result = done.result;
+                job->task->waiting = 0;
+            }
+            waitpid(job->helper, NULL, 0);
+            *job = loop->jobs[--loop->num_jobs];
+            break;
+        }
+    }
+}
+
+/*
+ * Forgets the operation 't' waits on, which runs to completion
+ * regardless. Its job stays until then, for the helper to be reaped.
+ */
+void task_cancel(task_loop *loop, task *t) {
+
+    int i;
+
+    if (!t->waiting) return;
+    for (i = 0; i < loop->num_jobs; i++) {
+        if (loop->jobs[i].task == t) {
+            loop->jobs[i].task = NULL;
+            break;
+        }
+    }
+    t->waiting = 0;
+}
+
+// helpers still running are reaped by init once the worker exits
+void task_loop_free(task_loop *loop) {
+
+    int i;
+
+    for (i = 0; i < loop->num_jobs; i++) waitpid(loop->jobs[i].helper, NULL, WNOHANG);
+    if (loop->wake[0] == -1) return;
+    close(loop->wake[0]);
+    close(loop->wake[1]);
+}
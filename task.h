@@ -0,0 +1,76 @@
+/*
+ * File: task.h
+ */
+
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include <sys/types.h>
+
+/*
+ * Resumable functions, in the style of protothreads. A task function
+ * starts with TASK_BEGIN and ends with TASK_END, and may suspend itself
+ * in between with TASK_AWAIT on an operation started by task_offload().
+ * It then returns TASK_PENDING, and is called again once the operation
+ * completed, resuming right after the TASK_AWAIT. Locals do not survive
+ * a suspension: whatever is needed afterwards lives in the task's frame.
+ */
+
+typedef enum {
+    TASK_DONE, TASK_PENDING
+} task_status;
+
+typedef struct task {
+    int line;           // where to resume, 0 before the first run
+    int waiting;        // for the operation started last
+    int result;         // of that operation, once it completed
+    unsigned job;
+} task;
+
+#define TASK_MAX_JOBS 128   // operations in progress per connection
+
+typedef struct task_job {
+    unsigned id;
+    task *task;
+    pid_t helper;
+} task_job;
+
+/*
+ * The operations in progress on a connection. Helpers report back over
+ * a pipe, which the connection polls alongside its socket.
+ */
+typedef struct task_loop {
+    int wake[2];
+    task_job jobs[TASK_MAX_JOBS];
+    int num_jobs;
+    unsigned next_id;
+} task_loop;
+
+#define TASK_BEGIN(t) switch ((t)->line) { case 0:;
+
+/*
+ * Starts 'operation', which is a call to task_offload(), and suspends
+ * the task until it completes. Afterwards (t)->result holds its result.
+ */
+#define TASK_AWAIT(t, operation) \
+    do { \
+        if (operation) { \
+            (t)->line = __LINE__; \
+            case __LINE__: \
+            if ((t)->waiting) return TASK_PENDING; \
+        } \
+    } while (0)
+
+#define TASK_RETURN(t) do { (t)->line = -1; return TASK_DONE; } while (0)
+
+#define TASK_END(t) } (t)->line = -1; return TASK_DONE
+
+#define TASK_RUNNING(t) ((t)->line > 0)
+
+void task_loop_init(task_loop *loop);
+int task_offload(task_loop *loop, task *t, int (*operation)(void *), void *arg);
+void task_loop_collect(task_loop *loop);
+void task_cancel(task_loop *loop, task *t);
+void task_loop_free(task_loop *loop);
+
+#endif
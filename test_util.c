@@ -29,5 +29,22 @@ int main(void) {
     printf("Accept-Encoding: '%s'\n", http_parse_header_field(req, len, "Accept-Encoding"));
     printf("Host: '%s'\n", http_parse_header_field(req, len, "Host"));
     
+    char encoded[3 * 64 + 1], decoded[64 + 1];
+    char in_place[] = "a+b%20c%2Fd%zz%4";
+    printf("Encode: '%s'\n", encode("a b/c\xe9~", encoded));
+    printf("Decode: '%s'\n", decode(encoded, decoded));
+    printf("Decode in place: '%s'\n", decode(in_place, in_place));
+    printf("Cookie: '%s'\n", build_cookie_string("item 1", "x&y", "86400", "/"));
+    
+    char query[] = "xusername=eve&username=a%20b&flag&&url=http%3A%2F%2Fx%2F%3Fq%3D1&us%65r=c+d";
+    param_map params;
+    params_parse(&params, query);
+    printf("Parameters: %d\n", params.count);
+    printf("username: '%s'\n", params_get(&params, "username"));
+    printf("url: '%s'\n", params_get(&params, "url"));
+    printf("user: '%s'\n", params_get(&params, "user"));
+    printf("flag: '%s'\n", params_get(&params, "flag"));
+    printf("name: '%s'\n", params_get(&params, "name") ? "found" : "(null)");
+    
     return 0;
 }
@@ -0,0 +1,186 @@
+/*
+ * File: timerwheel.c
+ */
+
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+/*
+ * Hierarchical timing wheel. Level 0 holds timers due within the next
+ * WHEEL_SLOTS ticks, each higher level covers WHEEL_SLOTS times the
+ * range of the one below. Timers in higher levels are cascaded down
+ * when their slot comes up, so scheduling, cancelling and firing a
+ * timer are all O(1).
+ */
+
+static void list_init(timer_entry *head) {
+
+    head->next = head->prev = head;
+}
+
+static void list_splice(timer_entry *from, timer_entry *to) {
+
+    list_init(to);
+    if (from->next == from) return;
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+static void unlink_timer(timer_wheel *wheel, timer_entry *timer) {
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    wheel->count[timer->level]--;
+}
+
+static void place(timer_wheel *wheel, timer_entry *timer) {
+
+    uint64_t delta = timer->expires - wheel->now;
+    uint64_t slot_tick = timer->expires;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1))) break;
+
+    // Beyond the range of the wheel: park in the furthest top-level
+    // slot, it will be placed again when that slot is cascaded.
+    if (level == WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * WHEEL_LEVELS))
+        slot_tick = wheel->now + ((uint64_t)(WHEEL_SLOTS - 1) << (WHEEL_BITS * level));
+
+    timer_entry *head = &wheel->slots[level][(slot_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    timer->level = level;
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel->count[level]++;
+}
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now) {
+
+    int level, slot;
+
+    wheel->now = now;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        wheel->count[level] = 0;
+        for (slot = 0; slot < WHEEL_SLOTS; slot++)
+            list_init(&wheel->slots[level][slot]);
+    }
+}
+
+void timer_init(timer_entry *timer, void (*callback)(timer_entry *, void *), void *arg) {
+
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->level = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+/*
+ * (Re)schedules 'timer' to fire at tick 'expires'. Timers already due
+ * fire on the next advance.
+ */
+void timer_schedule(timer_wheel *wheel, timer_entry *timer, uint64_t expires) {
+
+    if (timer_pending(timer)) unlink_timer(wheel, timer);
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    place(wheel, timer);
+}
+
+void timer_cancel(timer_wheel *wheel, timer_entry *timer) {
+
+    if (timer_pending(timer)) unlink_timer(wheel, timer);
+}
+
+int timer_pending(const timer_entry *timer) {
+
+    return timer->next != NULL;
+}
+
+static void cascade(timer_wheel *wheel, int level) {
+
+    timer_entry pending, *timer;
+
+    list_splice(&wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)], &pending);
+    while ((timer = pending.next) != &pending) {
+        pending.next = timer->next;
+        timer->next->prev = &pending;
+        wheel->count[level]--;
+        place(wheel, timer);
+    }
+}
+
+static void fire(timer_wheel *wheel) {
+
+    timer_entry expired, *timer;
+
+    list_splice(&wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)], &expired);
+    while ((timer = expired.next) != &expired) {
+        expired.next = timer->next;
+        timer->next->prev = &expired;
+        timer->next = timer->prev = NULL;
+        wheel->count[0]--;
+        timer->callback(timer, timer->arg);
+    }
+}
+
+/*
+ * Moves the wheel forward to tick 'now', running the callback of every
+ * timer that expired on the way. Stretches with nothing in level 0 are
+ * skipped a whole revolution at a time.
+ */
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now) {
+
+    int level;
+
+    while (wheel->now < now) {
+        if (!wheel->count[0]) {
+            uint64_t boundary = (wheel->now | (WHEEL_SLOTS - 1)) + 1;
+            if (boundary > now) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = boundary;
+        } else {
+            wheel->now++;
+        }
+
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) break;
+            cascade(wheel, level);
+        }
+        fire(wheel);
+    }
+}
+
+/*
+ * Returns how many ticks the caller may sleep before the wheel needs to
+ * be advanced again, or -1 if no timer is pending.
+ */
+int64_t timer_wheel_timeout(const timer_wheel *wheel) {
+
+    int64_t best = -1;
+    int level, k;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (!wheel->count[level]) continue;
+
+        uint64_t index = wheel->now >> (WHEEL_BITS * level);
+        for (k = 1; k <= WHEEL_SLOTS; k++) {
+            const timer_entry *head = &wheel->slots[level][(index + k) & (WHEEL_SLOTS - 1)];
+            if (head->next != head) {
+                int64_t ticks = ((index + k) << (WHEEL_BITS * level)) - wheel->now;
+                if (best == -1 || ticks < best) best = ticks;
+                break;
+            }
+        }
+    }
+
+    return best;
+}
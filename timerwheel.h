@@ -0,0 +1,36 @@
+/*
+ * File: timerwheel.h
+ */
+
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4    // 64^4 ticks, a bit over 4.6 hours at 1ms per tick
+
+typedef struct timer_entry {
+    struct timer_entry *next, *prev;
+    uint64_t expires;
+    int level;
+    void (*callback)(struct timer_entry *timer, void *arg);
+    void *arg;
+} timer_entry;
+
+typedef struct timer_wheel {
+    uint64_t now;
+    int count[WHEEL_LEVELS];
+    timer_entry slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel;
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now);
+void timer_init(timer_entry *timer, void (*callback)(timer_entry *, void *), void *arg);
+void timer_schedule(timer_wheel *wheel, timer_entry *timer, uint64_t expires);
+void timer_cancel(timer_wheel *wheel, timer_entry *timer);
+int timer_pending(const timer_entry *timer);
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now);
+int64_t timer_wheel_timeout(const timer_wheel *wheel);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * File: tls.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+
+/*
+ * HTTPS termination. OpenSSL only runs the handshake: it is asked to
+ * hand the session keys to the kernel (kTLS) afterwards, so responses
+ * keep going out with sendmsg() and sendfile() and are encrypted on
+ * the way. Where the kernel cannot take them, records are encrypted
+ * here instead, which costs a copy of everything sent.
+ */
+
+tls_config tls_conf = {
+    NULL,   // cert
+    NULL    // key
+};
+
+static SSL_CTX *context;
+
+// prefers HTTP/2, which the connection then detects by its preface
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+        const unsigned char *in, unsigned int in_len, void *arg) {
+
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+
+    if (SSL_select_next_proto((unsigned char **)out, out_len, protocols, sizeof(protocols) - 1,
+            in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * Loads the certificate and key in tls_conf, once in the parent so that
+ * every worker inherits them. Does nothing without a certificate.
+ * Returns -1 if they cannot be used.
+ */
+int tls_init(void) {
+
+    if (!tls_conf.cert) return 0;
+
+    context = SSL_CTX_new(TLS_server_method());
+    if (!context) goto failed;
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    // tls_flush() gathers a record afresh every time it is retried
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_alpn_select_cb(context, select_protocol, NULL);
+    if (SSL_CTX_use_certificate_chain_file(context, tls_conf.cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, tls_conf.key ? tls_conf.key : tls_conf.cert, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1) goto failed;
+    return 0;
+
+failed:
+    ERR_print_errors_fp(stderr);
+    if (context) SSL_CTX_free(context);
+    context = NULL;
+    return -1;
+}
+
+/*
+ * Runs the handshake on the non-blocking 'socket', waiting at most
+ * TLS_HANDSHAKE_TIMEOUT for the client. Returns 0 once the connection
+ * is secured and -1 if it has to be closed.
+ */
+int tls_accept(tls_session *session, int socket) {
+
+    memset(session, 0, sizeof(tls_session));
+    if (!(session->ssl = SSL_new(context)) || SSL_set_fd(session->ssl, socket) != 1) {
+        tls_close(session);
+        return -1;
+    }
+
+    for (;;) {
+        int result = SSL_accept(session->ssl);
+        struct pollfd pfd = {socket, 0, 0};
+
+        if (result == 1) break;
+        switch (SSL_get_error(session->ssl, result)) {
+            case SSL_ERROR_WANT_READ: pfd.events = POLLIN; break;
+            case SSL_ERROR_WANT_WRITE: pfd.events = POLLOUT; break;
+            default:
+                ERR_clear_error();
+                tls_close(session);
+                return -1;
+        }
+        int ready = poll(&pfd, 1, TLS_HANDSHAKE_TIMEOUT);
+        if (ready == 0 || (ready < 0 && errno != EINTR)) {
+            tls_close(session);
+            return -1;
+        }
+    }
+
+    session->ktls_send = BIO_get_ktls_send(SSL_get_wbio(session->ssl));
+    session->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(session->ssl));
+    return 0;
+}
+
+/*
+ * Reads decrypted request bytes, like recv(): returns how many, 0 once
+ * the client has closed and -1 with errno set otherwise. OpenSSL reads
+ * through the kernel itself when it decrypts.
+ */
+ssize_t tls_recv(tls_session *session, void *buffer, size_t length) {
+
+    int received = SSL_read(session->ssl, buffer, length);
+
+    if (received > 0) return received;
+    switch (SSL_get_error(session->ssl, received)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            ERR_clear_error();
+            errno = ECONNRESET;
+            return -1;
+    }
+}
+
+// true if bytes already read from the socket wait to be taken, so poll() would not report them
+int tls_pending(tls_session *session) {
+
+    return SSL_pending(session->ssl) > 0;
+}
+
+/*
+ * Writes as much of the queue as the socket accepts, like outq_flush().
+ * Without kTLS each call encrypts one record, gathered from as many
+ * segments as fill it; files are read into it.
+ */
+int tls_flush(tls_session *session, outqueue *q, int socket) {
+
+    char record[TLS_RECORD];
+
+    if (session->ktls_send) return outq_flush(q, socket);
+
+    while (q->head) {
+        out_segment *seg;
+        size_t n = 0;
+        int sent;
+
+        if (!q->head->length) {
+            outq_consume(q, 0);
+            continue;
+        }
+        for (seg = q->head; seg && n < sizeof(record); seg = seg->next) {
+            size_t chunk = seg->length < sizeof(record) - n ? seg->length : sizeof(record) - n;
+            if (seg->data) {
+                memcpy(record + n, seg->data + seg->offset, chunk);
+            } else {
+                ssize_t r = pread(seg->fd, record + n, chunk, seg->offset);
+                // the file shrank underneath us, nothing sensible left to send
+                if (r <= 0 && !n) return -1;
+                if (r < (ssize_t)chunk) {
+                    n += r > 0 ? r : 0;
+                    break;
+                }
+            }
+            n += chunk;
+        }
+
+        sent = SSL_write(session->ssl, record, n);
+        if (sent <= 0) {
+            int error = SSL_get_error(session->ssl, sent);
+            if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) return 0;
+            ERR_clear_error();
+            return -1;
+        }
+        outq_consume(q, sent);
+    }
+    return 1;
+}
+
+// tells the client the connection is over, without waiting for its answer
+void tls_close(tls_session *session) {
+
+    if (!session->ssl) return;
+    if (SSL_is_init_finished(session->ssl)) SSL_shutdown(session->ssl);
+    ERR_clear_error();
+    SSL_free(session->ssl);
+    session->ssl = NULL;
+}
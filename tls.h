@@ -0,0 +1,39 @@
+/*
+ * File: tls.h
+ */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+
+#include "outqueue.h"
+
+#define TLS_RECORD 16384            // plaintext bytes in a full TLS record
+#define TLS_HANDSHAKE_TIMEOUT 10000 // milliseconds a client may take to finish the handshake
+
+typedef struct tls_config {
+    const char *cert;       // PEM certificate chain, NULL to serve plain HTTP
+    const char *key;        // PEM private key, the certificate file if NULL
+} tls_config;
+
+extern tls_config tls_conf;
+
+/*
+ * TLS on one connection. Once the kernel encrypts on its own (kTLS),
+ * responses are written to the socket as they would be without TLS.
+ */
+typedef struct tls_session {
+    struct ssl_st *ssl;
+    int ktls_send;
+    int ktls_recv;
+} tls_session;
+
+int tls_init(void);
+int tls_accept(tls_session *session, int socket);
+ssize_t tls_recv(tls_session *session, void *buffer, size_t length);
+int tls_pending(tls_session *session);
+int tls_flush(tls_session *session, outqueue *q, int socket);
+void tls_close(tls_session *session);
+
+#endif
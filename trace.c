@@ -0,0 +1,220 @@
+/*
+ * File: trace.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+#include "service.h"
+#include "util.h"
+
+/*
+ * Request phase tracing. A sample of the requests has the duration of
+ * each phase recorded, with monotonic timestamps, into lanes in a
+ * shared mapping the parent sets up before it forks. A worker claims a
+ * lane for as long as it lives and is its only writer, so recording
+ * takes no locks. The parent writes all lanes out as Chrome trace JSON
+ * when asked to with SIGUSR2; events overwritten while it does so may
+ * come out torn, which a sampling profiler can live with.
+ */
+
+typedef struct trace_event {
+    int64_t start_ns;
+    int64_t duration_ns;
+    pid_t pid;
+    uint32_t id;
+    uint16_t status;
+    uint8_t phase;
+    uint8_t command;
+} trace_event;
+
+typedef struct trace_lane {
+    _Atomic pid_t owner;
+    _Atomic uint64_t head;      // events ever recorded, the latest at head-1
+    trace_event events[];
+} trace_lane;
+
+typedef struct trace_state {
+    _Atomic uint64_t requests;  // seen by the sampler
+    char lanes[];
+} trace_state;
+
+static const char *phase_names[] = {"recv", "parse", "body", "admission", "handler", "helper",
+    "response", "send"};
+
+trace_config trace_conf = {
+    0,      // sample
+    4096,   // events
+    "/tmp/cshttp-trace.json"
+};
+
+volatile sig_atomic_t trace_dump_requested = 0;
+
+static trace_state *state;
+static size_t lane_size;
+static trace_lane *lane;        // claimed by this process
+static pid_t lane_pid;
+
+void trace_request_dump(int sig) {
+    trace_dump_requested = 1;
+}
+
+// must be called before the first fork() so that every worker shares the lanes
+void trace_init(void) {
+
+    if (!trace_conf.sample) return;
+
+    lane_size = sizeof(trace_lane) + (size_t)trace_conf.events * sizeof(trace_event);
+    state = mmap(NULL, sizeof(trace_state) + TRACE_LANES * lane_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("trace");
+        exit(1);
+    }
+}
+
+static trace_lane *lane_at(int i) {
+    return (trace_lane *)(state->lanes + i * lane_size);
+}
+
+// the lane of this process, or NULL when all of them are taken
+static trace_lane *own_lane(void) {
+
+    pid_t self = getpid();
+    int i;
+
+    // a forked worker must not go on writing to its parent's lane
+    if (lane && lane_pid == self) return lane;
+    lane = NULL;
+    for (i = 0; i < TRACE_LANES && !lane; i++) {
+        trace_lane *l = lane_at(i);
+        pid_t owner = atomic_load(&l->owner);
+        if (owner && (kill(owner, 0) == 0 || errno != ESRCH)) continue;
+        if (atomic_compare_exchange_strong(&l->owner, &owner, self)) lane = l;
+    }
+    lane_pid = self;
+    return lane;
+}
+
+static void record(trace_span *t, request_phase phase, int64_t start, int64_t end) {
+
+    trace_lane *l = own_lane();
+    if (!l) return;
+
+    uint64_t head = atomic_load_explicit(&l->head, memory_order_relaxed);
+    trace_event *e = &l->events[head % trace_conf.events];
+    e->start_ns = start;
+    e->duration_ns = end - start;
+    e->pid = lane_pid;
+    e->id = t->id;
+    e->status = t->status;
+    e->phase = phase;
+    e->command = t->command;
+    atomic_store_explicit(&l->head, head + 1, memory_order_release);
+}
+
+/*
+ * Starts the span of a request which began arriving at 'begin', if it
+ * is sampled. A span whose response is still being sent is finished
+ * first.
+ */
+void trace_request(trace_span *t, uint32_t id, int64_t begin) {
+
+    if (!state) return;
+    trace_sent(t);
+
+    t->sampled = atomic_fetch_add(&state->requests, 1) % trace_conf.sample == 0;
+    if (!t->sampled) return;
+    t->id = id;
+    t->command = NOTA;
+    t->status = 0;
+    t->begin = t->mark = begin ? begin : monotonic_ns();
+}
+
+void trace_phase(trace_span *t, request_phase phase) {
+
+    if (!t || !t->sampled) return;
+    int64_t now = monotonic_ns();
+    record(t, phase, t->mark, now);
+    t->mark = now;
+    t->last = phase;
+}
+
+// finishes the span once the output queue took the whole response
+void trace_sent(trace_span *t) {
+
+    if (!t->sampled || t->last != TRACE_RESPONSE) return;
+    trace_phase(t, TRACE_SEND);
+    record(t, TRACE_REQUEST, t->begin, t->mark);
+    t->sampled = 0;
+}
+
+// hands the lane of an exiting worker to the next one
+void trace_release(void) {
+
+    if (lane && lane_pid == getpid()) {
+        pid_t self = lane_pid;
+        atomic_compare_exchange_strong(&lane->owner, &self, 0);
+    }
+    lane = NULL;
+}
+
+/*
+ * Writes every event still held in the lanes to 'path' as Chrome trace
+ * JSON, which chrome://tracing and Perfetto open. Requests are slices
+ * named after their command, with the phases nested under them, one
+ * row per request of a worker. Only the server's user may read it.
+ * Returns 0, or -1 if the file could not be written.
+ */
+int trace_dump(const char *path) {
+
+    char *tmp_path;
+    FILE *out;
+    int i, first = 1;
+
+    if (!state) return -1;
+    tmp_path = malloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+    if (!(out = create_private(tmp_path))) {
+        free(tmp_path);
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i = 0; i < TRACE_LANES; i++) {
+        trace_lane *l = lane_at(i);
+        uint64_t head = atomic_load_explicit(&l->head, memory_order_acquire), n;
+        uint64_t count = head < (uint64_t)trace_conf.events ? head : (uint64_t)trace_conf.events;
+
+        for (n = head - count; n < head; n++) {
+            trace_event e = l->events[n % trace_conf.events];
+            if (e.phase >= NUM_TRACE_PHASES) continue;
+            const char *name = e.phase == TRACE_REQUEST ?
+                (e.command < NOTA ? command_str[e.command] : "request") : phase_names[e.phase];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,"
+                "\"dur\":%lld.%03lld,\"pid\":%d,\"tid\":%u",
+                first ? "" : ",", name, e.phase == TRACE_REQUEST ? "request" : "phase",
+                (long long)(e.start_ns / 1000), (long long)(e.start_ns % 1000),
+                (long long)(e.duration_ns / 1000), (long long)(e.duration_ns % 1000),
+                (int)e.pid, e.id);
+            if (e.phase == TRACE_REQUEST) fprintf(out, ",\"args\":{\"status\":%d}", e.status);
+            fputc('}', out);
+            first = 0;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0 || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return 0;
+}
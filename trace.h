@@ -0,0 +1,57 @@
+/*
+ * File: trace.h
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <signal.h>
+
+#define TRACE_LANES 64      // workers recording at once, each into its own lane
+
+typedef enum {
+    TRACE_RECV,         // from the first byte to the end of the request header
+    TRACE_PARSE,
+    TRACE_BODY,
+    TRACE_ADMISSION,
+    TRACE_HANDLER,
+    TRACE_HELPER,       // waiting for an operation the handler offloaded
+    TRACE_RESPONSE,     // serializing and queueing the response
+    TRACE_SEND,         // until the output queue has taken all of it
+    TRACE_REQUEST,      // the whole request, recorded last
+    NUM_TRACE_PHASES
+} request_phase;
+
+typedef struct trace_config {
+    int sample;             // trace one request in this many, 0: never
+    int events;             // per lane
+    const char *path;       // where a dump is written
+} trace_config;
+
+extern trace_config trace_conf;
+extern volatile sig_atomic_t trace_dump_requested;
+
+/*
+ * The phases of one request recorded so far. Each phase lasts from the
+ * end of the previous one to the call that records it.
+ */
+typedef struct trace_span {
+    int sampled;
+    uint32_t id;            // the request on its connection, a row in the trace
+    int command;
+    int status;
+    int64_t begin;
+    int64_t mark;           // end of the last phase recorded
+    request_phase last;
+} trace_span;
+
+void trace_init(void);
+void trace_request(trace_span *t, uint32_t id, int64_t begin);
+void trace_phase(trace_span *t, request_phase phase);
+void trace_sent(trace_span *t);
+void trace_release(void);
+void trace_request_dump(int sig);
+int trace_dump(const char *path);
+
+#endif
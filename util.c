@@ -7,8 +7,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "util.h"
+#include "alloc.h"
 
 const char *http_method_str[] = {"GET", "POST", "HEAD", "OPTIONS", "PUT",
     "DELETE", "TRACE", "CONNECT"};
@@ -170,48 +174,200 @@ const char *http_parse_body(const char *request, int length) {
 }
 
 /*
- * Encodes the string 'original' into 'encoded'. It is recommended
- * that 'encoded' has space for at least 3*strlen(original)+1. For
- * convenience, returns 'encoded'.
+ * Percent-encoding tables. url_safe marks the bytes that are copied
+ * as they are (alphanumerics), hex_value maps a hex digit to its value
+ * and everything else to -1.
  */
-char *encode(const char *original, char *encoded) {
+static const char hex_digits[] = "0123456789ABCDEF";
+static unsigned char url_safe[256];
+static signed char hex_value[256];
+
+static void init_url_tables(void) {
+    
+    static int initialized = 0;
+    int c;
     
+    if (initialized) return;
+    for (c = 0; c < 256; c++) {
+        url_safe[c] = isalnum(c) != 0;
+        hex_value[c] = -1;
+    }
+    for (c = 0; c < 10; c++) hex_value['0' + c] = c;
+    for (c = 0; c < 6; c++) hex_value['a' + c] = hex_value['A' + c] = 10 + c;
+    initialized = 1;
+}
+
+/*
+ * Percent-encodes the 'length' bytes at 'original' into 'encoded',
+ * which needs space for 3*length+1 bytes. Returns the length of the
+ * encoded string.
+ */
+int url_encode(const char *original, int length, char *encoded) {
+    
+    const unsigned char *o = (const unsigned char *)original;
     char *e = encoded;
-    for(;*original; original++, encoded++) {
-        if (isalnum(*original))
-            *encoded = *original;
-        else if (*original == ' ')
-            *encoded = '+';
+    
+    init_url_tables();
+    for (; length > 0; o++, length--) {
+        if (url_safe[*o])
+            *e++ = *o;
+        else if (*o == ' ')
+            *e++ = '+';
         else {
-            sprintf(encoded, "%%%02X", *original);
-            encoded += 2;
+            e[0] = '%';
+            e[1] = hex_digits[*o >> 4];
+            e[2] = hex_digits[*o & 15];
+            e += 3;
+        }
+    }
+    *e = '\0';
+    return e - encoded;
+}
+
+// true if any of the 8 bytes in 'word' is '%' or '+'
+static inline int has_escape(uint64_t word) {
+    
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    uint64_t pct = word ^ (ones * '%'), plus = word ^ (ones * '+');
+    
+    return ((((pct - ones) & ~pct) | ((plus - ones) & ~plus)) & highs) != 0;
+}
+
+/*
+ * Decodes the 'length' bytes at 'original' into 'decoded', which may be
+ * the same buffer since decoding never grows the string. Runs without
+ * escapes are skipped eight bytes at a time. A '%' that is not followed
+ * by two hex digits is kept as it is. Returns the decoded length.
+ */
+int url_decode(const char *original, int length, char *decoded) {
+    
+    const char *o = original, *end = original + length;
+    char *d = decoded;
+    
+    init_url_tables();
+    while (o < end) {
+        const char *run = o;
+        uint64_t word;
+        
+        while (end - o >= 8) {
+            memcpy(&word, o, 8);
+            if (has_escape(word)) break;
+            o += 8;
+        }
+        while (o < end && *o != '%' && *o != '+') o++;
+        if (o != run) {
+            if (d != run) memmove(d, run, o - run);
+            d += o - run;
+        }
+        if (o == end) break;
+        
+        if (*o == '+') {
+            *d++ = ' ';
+            o++;
+        } else if (end - o >= 3 && hex_value[(unsigned char)o[1]] >= 0 &&
+                   hex_value[(unsigned char)o[2]] >= 0) {
+            *d++ = hex_value[(unsigned char)o[1]] << 4 | hex_value[(unsigned char)o[2]];
+            o += 3;
+        } else {
+            *d++ = *o++;
         }
     }
-    *encoded = '\0';
-    return e;
+    *d = '\0';
+    return d - decoded;
+}
+
+/*
+ * Encodes the string 'original' into 'encoded'. It is recommended
+ * that 'encoded' has space for at least 3*strlen(original)+1. For
+ * convenience, returns 'encoded'.
+ */
+char *encode(const char *original, char *encoded) {
+    
+    url_encode(original, strlen(original), encoded);
+    return encoded;
 }
 
 /*
  * Decodes the string 'original' into 'decoded'. It is recommended
- * that 'decoded' has space for at least strlen(original)+1. For
- * convenience, returns 'decoded'.
+ * that 'decoded' has space for at least strlen(original)+1, and it may
+ * be 'original' itself. For convenience, returns 'decoded'.
  */
 char *decode(const char *original, char *decoded) {
     
-    char *d = decoded;
-    for(;*original; original++, decoded++) {
-        if (*original == '+')
-            *decoded = ' ';
-        else if (*original == '%') {
-            unsigned int nr;
-            if (!sscanf(original, "%%%02X", &nr)) break;
-            *decoded = nr;
-            original += 2;
-        } else
-            *decoded = *original;
+    url_decode(original, strlen(original), decoded);
+    return decoded;
+}
+
+/*
+ * Splits the query string or form-urlencoded body 'query' into 'map',
+ * in place: every '&' and '=' is overwritten with a terminator, so the
+ * names and values in the map point into 'query' itself. Names are
+ * decoded right away, values only when first looked up. Parameters
+ * beyond PARAMS_MAX are ignored. 'query' may be NULL.
+ */
+void params_parse(param_map *map, char *query) {
+    
+    map->count = 0;
+    while (query && *query && map->count < PARAMS_MAX) {
+        param *p = &map->params[map->count];
+        char *end = strchr(query, '&'), *next = NULL, *eq;
+        
+        if (end) {
+            *end = '\0';
+            next = end + 1;
+        } else {
+            end = query + strlen(query);
+        }
+        
+        eq = memchr(query, '=', end - query);
+        if (eq) {
+            *eq = '\0';
+            p->value = eq + 1;
+            p->value_len = end - p->value;
+            p->decoded = 0;
+        } else {
+            p->value = end;
+            p->value_len = 0;
+            p->decoded = 1;
+        }
+        p->name = query;
+        url_decode(p->name, (eq ? eq : end) - query, p->name);
+        if (*p->name) map->count++;
+        
+        query = next;
     }
-    *decoded = '\0';
-    return d;
+}
+
+/*
+ * Returns the decoded value of the first parameter in 'map' called
+ * exactly 'name', ignoring case, or NULL if there is none. The value
+ * belongs to the string the map was parsed from.
+ */
+char *params_get(param_map *map, const char *name) {
+    
+    char *value;
+    
+    return params_get_all(map, name, &value, 1) ? value : NULL;
+}
+
+/*
+ * Sets 'values' to those of up to 'max' parameters named 'name', in
+ * the order they were given. Returns how many there are.
+ */
+int params_get_all(param_map *map, const char *name, char **values, int max) {
+    
+    int i, n = 0;
+    
+    for (i = 0; i < map->count && n < max; i++) {
+        param *p = &map->params[i];
+        if (strcasecmp(p->name, name)) continue;
+        if (!p->decoded) {
+            p->value_len = url_decode(p->value, p->value_len, p->value);
+            p->decoded = 1;
+        }
+        values[n++] = p->value;
+    }
+    return n;
 }
 
 char* new_response_header(char* code, char* message) {
@@ -258,45 +414,6 @@ void add_response_body(char** response, const char* body) {
 	(*response)[new_len-1] = '\0';
 }
 
-char* extract_parameter(const char* parameters, const char* name) {
-	if (!parameters) {
-		return NULL;
-	}
-	int total_len = strlen(parameters);
-	int name_len = strlen(name);
-	int val_len = 0;
-
-	char* start_pos = memchr(parameters, '=', total_len);
-
-	while (start_pos != NULL) {
-		if (!strncasecmp(start_pos - name_len, name, name_len)) {
-			break;
-		}
-		start_pos = memchr(start_pos+1, '=', total_len - (start_pos - parameters));
-	}
-
-	if (start_pos == NULL) {
-		return NULL;
-	}
-
-	while (start_pos + val_len + 1 < parameters+total_len && start_pos[val_len+1] != '&'){
-		val_len++;
-	}
-	char temp = start_pos[val_len+1];
-	start_pos[val_len+1] = '\0';
-
-	char* value = (char*)malloc(val_len+1);
-	strcpy(value, start_pos+1);
-	value[val_len] = '\0';
-
-	start_pos[val_len+1] = temp;
-
-	char* decoded_value = (char*)malloc(val_len+2);
-	decode(value, decoded_value);
-	free(value);
-	return decoded_value;
-}
-
 int has_cookie(const char* cookie_string, const char* name) {
 	if (!cookie_string) {
 		return false;
@@ -344,19 +461,9 @@ char* extract_cookie(const char* cookie_string, const char* name) {
 		val_len++;
 	}
 
-	char temp = start_pos[val_len+1];
-	start_pos[val_len+1] = '\0';
-
 	char* value = (char*)malloc(val_len+1);
-	strcpy(value, start_pos+1);
-	value[val_len] = '\0';
-
-	start_pos[val_len+1] = temp;
-
-	char* decoded_value = (char*)malloc(val_len+2);
-	decode(value, decoded_value);
-	free(value);
-	return decoded_value;
+	url_decode(start_pos+1, val_len, value);
+	return value;
 }
 
 void build_cookie_field(char* cookie_string, int* actual_len, const char* name, const char* value) {
@@ -368,24 +475,19 @@ void build_cookie_field(char* cookie_string, int* actual_len, const char* name,
 }
 
 char* build_cookie_string(const char* name, const char* value, const char* max_age, const char* path) {
-	int max_len = 3*strlen(name)+3*strlen(value)+3*strlen(path)+ 40; //sorry about magic number everywhere; will fix
+	int name_len = strlen(name);
+	int value_len = strlen(value);
+	int max_len = 3*name_len+3*value_len+strlen(max_age)+strlen(path)+sizeof("=; max-age=; path=");
 	int actual_len = 0;
 
 	char* cookie_string = (char*)malloc(max_len);
 
-	if (strlen(name) != 0) {
-		char* encoded_name = (char*)malloc(strlen(name)*3+1);
-		strcpy(cookie_string, encode(name, encoded_name));
-		actual_len += strlen(encoded_name);
+	if (name_len != 0) {
+		actual_len += url_encode(name, name_len, cookie_string);
 		cookie_string[actual_len++] = '=';
-
-		free(encoded_name);
 	}
 
-	char* encoded_value = (char*)malloc(strlen(value)*3+1);
-	strcpy(cookie_string+actual_len, encode(value, encoded_value));
-	actual_len += strlen(encoded_value);
-	free(encoded_value);
+	actual_len += url_encode(value, value_len, cookie_string+actual_len);
 
 	if (strlen(max_age) != 0) {
 		build_cookie_field(cookie_string, &actual_len, "; max-age=", max_age);
@@ -397,8 +499,6 @@ char* build_cookie_string(const char* name, const char* value, const char* max_a
 
 	cookie_string[actual_len] = '\0';
 
-	cookie_string = (char*)realloc(cookie_string, actual_len+1);
-
 	return cookie_string;
 }
 
@@ -420,6 +520,53 @@ char* get_gm_time_string(time_t* raw_time) {
 	return time_string;
 }
 
+// days since 1970-01-01 of a proleptic Gregorian date
+static long days_from_civil(int year, int month, int day) {
+	year -= month <= 2;
+	long era = (year >= 0 ? year : year-399) / 400;
+	int yoe = year - era*400;
+	int doy = (153*(month + (month > 2 ? -3 : 9)) + 2)/5 + day-1;
+	int doe = yoe*365 + yoe/4 - yoe/100 + doy;
+	return era*146097 + doe - 719468;
+}
+
+/*
+ * Parses an HTTP date in the preferred "Sun, 06 Nov 1994 08:49:37 GMT"
+ * format into 'parsed'. Returns 0 on success and -1 if the date is
+ * malformed. Clients tend to send back the same validator over and
+ * over, so the last date parsed is remembered.
+ */
+int http_parse_date(const char* date, time_t* parsed) {
+	static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	static char last_date[32];
+	static time_t last_parsed;
+	int day, year, hour, min, sec, month;
+	char month_name[4];
+
+	if (!strcmp(date, last_date)) {
+		*parsed = last_parsed;
+		return 0;
+	}
+
+	const char* comma = strchr(date, ',');
+	if (!comma || sscanf(comma+1, " %2d %3s %4d %2d:%2d:%2d", &day, month_name, &year, &hour, &min, &sec) != 6) {
+		return -1;
+	}
+	const char* found = strstr(months, month_name);
+	if (strlen(month_name) != 3 || !found || (found-months) % 3) {
+		return -1;
+	}
+	month = (found-months)/3 + 1;
+
+	*parsed = (time_t)days_from_civil(year, month, day)*86400 + hour*3600 + min*60 + sec;
+
+	if (strlen(date) < sizeof(last_date)) {
+		strcpy(last_date, date);
+		last_parsed = *parsed;
+	}
+	return 0;
+}
+
 char* get_local_time_string(time_t* raw_time) {
 	struct tm* ptm;
 	ptm = localtime(raw_time);	
@@ -447,15 +594,46 @@ void append(char** original, char* addage) {
 }
 
 char* itoa(int number) {
-	char* str = (char*)malloc(number);
+	char* str = (char*)malloc(12);
 	sprintf(str, "%d", number);
-	str = (char*)realloc(str, strlen(str));
 	return str;
 }
 
 char* hitoa(int number) {
-	char* str = (char*)malloc(number);
+	char* str = (char*)malloc(12);
 	sprintf(str, "%x", number);
-	str = (char*)realloc(str, strlen(str));
 	return str;
 }
+
+int64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+int64_t realtime_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Creates 'path' afresh for writing, readable by its owner only. A
+ * symlink is never followed, and a file left at 'path' is removed
+ * first, which a sticky directory such as /tmp only allows for files
+ * of our own. Returns NULL on failure.
+ */
+FILE* create_private(const char* path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd == -1 && errno == EEXIST && unlink(path) == 0) {
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	}
+	if (fd == -1) {
+		return NULL;
+	}
+	FILE* file = fdopen(fd, "w");
+	if (!file) {
+		close(fd);
+	}
+	return file;
+}
@@ -6,6 +6,9 @@
 #define _UTIL_H_
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 
 typedef enum {
     METHOD_GET, METHOD_POST, METHOD_HEAD, METHOD_OPTIONS, METHOD_PUT,
@@ -20,19 +23,42 @@ char *http_parse_uri(char *request);
 const char *http_parse_path(const char *uri);
 char *http_parse_header_field(char *request, int length, const char *header_field);
 const char *http_parse_body(const char *request, int length);
+int url_encode(const char *original, int length, char *encoded);
+int url_decode(const char *original, int length, char *decoded);
 char *encode(const char *original, char *encoded);
 char *decode(const char *original, char *decoded);
 
+#define PARAMS_MAX 64
+
+typedef struct param {
+    char *name;
+    char *value;
+    int value_len;
+    int decoded;        // 'value' has been decoded in place
+} param;
+
+typedef struct param_map {
+    param params[PARAMS_MAX];
+    int count;
+} param_map;
+
+void params_parse(param_map *map, char *query);
+char *params_get(param_map *map, const char *name);
+int params_get_all(param_map *map, const char *name, char **values, int max);
+
 char* new_response_header(char* code, char* message);
 void add_header_field(char** header, const char* name, const char* value);
 void add_response_body(char** response, const char* body);
-char* extract_parameter(const char* parameters, const char* name);
 char* extract_cookie(const char* cookie, const char* name);
 int has_cookie(const char* cookie, const char* name);
 char* build_cookie_string(const char* name, const char* value, const char* expires, const char* path);
 char* get_gm_time_string(time_t* raw_time);
 char* get_local_time_string(time_t* raw_time);
+int http_parse_date(const char* date, time_t* parsed);
 char* itoa(int number);
 char* hitoa(int number);
 void append(char** original, char* addage);
+int64_t monotonic_ns(void);
+int64_t realtime_ns(void);
+FILE* create_private(const char* path);
 #endif